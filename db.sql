@@ -38,13 +38,19 @@ CREATE TABLE IF NOT EXISTS `cards` (
 	`user_id`		INTEGER UNSIGNED	NOT NULL,
 	`pin`			BINARY(128)		NOT NULL,
 	`attempts`		TINYINT UNSIGNED	NOT NULL,
+	-- lookup key for logins, some other groups omit the last 2 characters of IBANs
+	`iban_key`		CHAR(16)		AS (LEFT(`iban`, 16)) PERSISTENT,
 	PRIMARY KEY (`card_id`),
+	INDEX (`iban_key`),
 	FOREIGN KEY (`iban`) REFERENCES `accounts` (`iban`)
 		ON DELETE RESTRICT ON UPDATE CASCADE,
 	FOREIGN KEY (`user_id`) REFERENCES `users` (`user_id`)
 		ON DELETE RESTRICT ON UPDATE CASCADE
 );
 
+-- Transfers are recorded by the `transfer_apply` procedure, together with the transfer itself. Withdrawals with cards
+-- of other banks (NOOB) don't go through it, hb-server records those in batches from a background thread, so their rows
+-- may show up a little later (they're kept in hb-server's spill file until the database has them).
 CREATE TABLE IF NOT EXISTS `transactions` (
 	`transaction_id`	INTEGER UNSIGNED	NOT NULL UNIQUE AUTO_INCREMENT,
 	`status`		TINYINT UNSIGNED	NOT NULL,
@@ -52,9 +58,75 @@ CREATE TABLE IF NOT EXISTS `transactions` (
 	`source_iban`		VARCHAR(34),
 	`dest_iban`		VARCHAR(34),
 	`amount`		BIGINT			NOT NULL,
-	PRIMARY KEY (`transaction_id`)
+	PRIMARY KEY (`transaction_id`),
+	-- the history of an account is paged through by `transaction_id` (HBP_REQ_HISTORY)
+	INDEX (`source_iban`, `transaction_id`),
+	INDEX (`dest_iban`, `transaction_id`)
 );
 
+-- Databases created before `cards`.`iban_key` was added can be upgraded using:
+-- ALTER TABLE `cards` ADD COLUMN IF NOT EXISTS `iban_key` CHAR(16) AS (LEFT(`iban`, 16)) PERSISTENT,
+--	ADD INDEX IF NOT EXISTS (`iban_key`);
+-- Databases created before the `transactions` indexes were added can be upgraded using:
+-- ALTER TABLE `transactions` ADD INDEX IF NOT EXISTS `source_iban` (`source_iban`, `transaction_id`),
+--	ADD INDEX IF NOT EXISTS `dest_iban` (`dest_iban`, `transaction_id`);
+
+--
+-- Transfer an amount from one account to another (or withdraw it if `dest` is empty) as part of the current
+-- transaction, transfers of different sessions are committed together this way
+-- The debit only happens if the balance is sufficient. Returns a single row, 1 if the transfer succeeded and 0 if the
+-- funds were insufficient (or the source account doesn't exist). A transfer that fails is rolled back on its own.
+-- A transfer that succeeds is recorded in `transactions` as part of the same transaction.
+--
+DELIMITER //
+CREATE PROCEDURE IF NOT EXISTS `transfer_apply` (IN `source` VARCHAR(34), IN `dest` VARCHAR(34), IN `amount` BIGINT)
+	MODIFIES SQL DATA
+BEGIN
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK TO SAVEPOINT `transfer`;
+		RESIGNAL;
+	END;
+
+	SAVEPOINT `transfer`;
+
+	UPDATE `accounts` SET `balance` = `balance` - `amount` WHERE `iban` = `source` AND `balance` >= `amount`;
+	IF ROW_COUNT() = 0 THEN
+		SELECT 0 AS `result`;
+	ELSE
+		IF `dest` <> '' THEN
+			UPDATE `accounts` SET `balance` = `balance` + `amount` WHERE `iban` = `dest`;
+			IF ROW_COUNT() = 0 THEN
+				SIGNAL SQLSTATE '45000' SET MESSAGE_TEXT = 'Unknown destination account';
+			END IF;
+		END IF;
+
+		-- status 0 is HBP_TRANSFER_SUCCESS
+		INSERT INTO `transactions` (`status`, `time`, `source_iban`, `dest_iban`, `amount`)
+			VALUES (0, NOW(), `source`, NULLIF(`dest`, ''), `amount`);
+
+		SELECT 1 AS `result`;
+	END IF;
+END //
+
+--
+-- Same as `transfer_apply`, but in a transaction of its own
+--
+CREATE PROCEDURE IF NOT EXISTS `transfer` (IN `source` VARCHAR(34), IN `dest` VARCHAR(34), IN `amount` BIGINT)
+	MODIFIES SQL DATA
+BEGIN
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+	CALL `transfer_apply`(`source`, `dest`, `amount`);
+	COMMIT;
+END //
+DELIMITER ;
+
 --
 -- WARNING!
 -- Change the passwords before loading this file
@@ -66,6 +138,11 @@ GRANT SELECT ON `herbankdb`.* TO `hb-server`@`localhost`;
 GRANT INSERT ON `herbankdb`.`transactions` TO `hb-server`@`localhost`;
 GRANT UPDATE ON `herbankdb`.`cards` TO `hb-server`@`localhost`;
 GRANT UPDATE ON `herbankdb`.`accounts` TO `hb-server`@`localhost`;
+GRANT EXECUTE ON PROCEDURE `herbankdb`.`transfer` TO `hb-server`@`localhost`;
+GRANT EXECUTE ON PROCEDURE `herbankdb`.`transfer_apply` TO `hb-server`@`localhost`;
+-- When using replicas (-r), hb-server checks their replication lag, this requires:
+-- GRANT SLAVE MONITOR ON *.* TO `hb-server`@`localhost`;
+-- (REPLICATION CLIENT before MariaDB 10.5)
 
 -- This user is used by hb-cli
 CREATE USER 'hb-cli'@'localhost' IDENTIFIED BY 'password';
@@ -0,0 +1,60 @@
+--
+-- Schema for hb-server built with SQLITE=ON, load it using:
+-- $ sqlite3 herbank.db < sqlite.sql
+--
+-- The same tables as db.sql, transfers are done by hb-server itself as SQLite has no stored procedures.
+--
+
+PRAGMA journal_mode = WAL;
+
+CREATE TABLE IF NOT EXISTS `users` (
+	`user_id`		INTEGER			NOT NULL PRIMARY KEY,
+	`first_name`		VARCHAR(128)		NOT NULL,
+	`last_name`		VARCHAR(128)		NOT NULL
+);
+
+CREATE TABLE IF NOT EXISTS `accounts` (
+	`iban`			VARCHAR(34)		NOT NULL PRIMARY KEY,
+	`type`			TINYINT UNSIGNED	NOT NULL,
+	`balance`		BIGINT			NOT NULL
+);
+
+CREATE TABLE IF NOT EXISTS `registrations` (
+	`registration_id`	INTEGER			NOT NULL PRIMARY KEY,
+	`user_id`		INTEGER			NOT NULL,
+	`iban`			VARCHAR(34)		NOT NULL,
+	FOREIGN KEY (`user_id`) REFERENCES `users` (`user_id`)
+		ON DELETE RESTRICT ON UPDATE CASCADE,
+	FOREIGN KEY (`iban`) REFERENCES `accounts` (`iban`)
+		ON DELETE RESTRICT ON UPDATE CASCADE
+);
+
+CREATE TABLE IF NOT EXISTS `cards` (
+	`card_id`		VARCHAR(12)		NOT NULL PRIMARY KEY,
+	`iban`			VARCHAR(34)		NOT NULL,
+	`user_id`		INTEGER			NOT NULL,
+	`pin`			VARCHAR(128)		NOT NULL,
+	`attempts`		TINYINT UNSIGNED	NOT NULL,
+	-- lookup key for logins, some other groups omit the last 2 characters of IBANs
+	`iban_key`		CHAR(16)		AS (substr(`iban`, 1, 16)) STORED,
+	FOREIGN KEY (`iban`) REFERENCES `accounts` (`iban`)
+		ON DELETE RESTRICT ON UPDATE CASCADE,
+	FOREIGN KEY (`user_id`) REFERENCES `users` (`user_id`)
+		ON DELETE RESTRICT ON UPDATE CASCADE
+);
+CREATE INDEX IF NOT EXISTS `cards_iban_key` ON `cards` (`iban_key`);
+
+-- `time` is a UNIX timestamp
+-- Transfers are recorded together with the transfer itself, withdrawals with cards of other banks (NOOB) are recorded
+-- in batches by a background thread (see db.sql)
+CREATE TABLE IF NOT EXISTS `transactions` (
+	`transaction_id`	INTEGER			NOT NULL PRIMARY KEY,
+	`status`		TINYINT UNSIGNED	NOT NULL,
+	`time`			INTEGER			NOT NULL,
+	`source_iban`		VARCHAR(34),
+	`dest_iban`		VARCHAR(34),
+	`amount`		BIGINT			NOT NULL
+);
+-- the history of an account is paged through by `transaction_id` (HBP_REQ_HISTORY)
+CREATE INDEX IF NOT EXISTS `transactions_source_iban` ON `transactions` (`source_iban`, `transaction_id`);
+CREATE INDEX IF NOT EXISTS `transactions_dest_iban` ON `transactions` (`dest_iban`, `transaction_id`);
@@ -24,6 +24,8 @@
  *
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "hbp.h"
@@ -31,42 +33,25 @@
 
 static bool local_balance(struct connection *conn, msgpack_packer *pack)
 {
-	MYSQL_RES *sqlres = NULL;
-	MYSQL_ROW row;
-	char *balance_str;
+	char balance_str[32];
+	int64_t balance;
+	int len;
 
-	/* retrieve this account's balance from the database */
-	sqlres = query(conn, "SELECT `balance` FROM `accounts` WHERE `iban` = '%s'", conn->iban);
-	if (!(row = mysql_fetch_row(sqlres))) {
+	/* retrieve this account's balance (in Eurocents) from the database, a replica will do unless we've just written */
+	if (db_balance(conn->iban, &balance, time(NULL) >= conn->primary_until) <= 0) {
 		dprintf("invalid IBAN: %s\n", conn->iban);
-		goto err;
+		return false;
 	}
 
-	/* create a new string and add the decimal point (hence +2 including null terminator) */
-	if (!(balance_str = malloc(strlen(row[0]) + 4)))
-		goto err;
-
-	if (strcmp(row[0], "0") == 0) {
-		strcpy(balance_str, "0.00");
-	} else {
-		memcpy(balance_str, row[0], strlen(row[0]) - 2);
-		balance_str[strlen(row[0]) - 2] = '.';
-		memcpy(balance_str + strlen(row[0]) - 1, row[0] + strlen(row[0]) - 2, 3);
-	}
+	/* add the decimal point */
+	len = snprintf(balance_str, sizeof(balance_str), "%s%lld.%02lld", balance < 0 ? "-" : "",
+			llabs(balance / 100), llabs(balance % 100));
 
 	/* @param balance */
-	msgpack_pack_str(pack, strlen(balance_str));
-	msgpack_pack_str_body(pack, balance_str, strlen(balance_str));
-
-	free(balance_str);
-	mysql_free_result(sqlres);
+	msgpack_pack_str(pack, len);
+	msgpack_pack_str_body(pack, balance_str, len);
 
 	return true;
-
-err:
-	mysql_free_result(sqlres);
-
-	return false;
 }
 
 static bool noob_balance(struct connection *conn, msgpack_packer *pack)
@@ -91,7 +76,7 @@ static bool noob_balance(struct connection *conn, msgpack_packer *pack)
 	return true;
 }
 
-bool balance(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack)
+bool balance(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack)
 {
 	/* @param type */
 	reply->type = HBP_REP_BALANCE;
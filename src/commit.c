@@ -0,0 +1,217 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+static pthread_t committer;
+static bool enabled, running;
+static unsigned int window, batch_max;
+
+/* transfers waiting for the next commit */
+static struct commit *head, *tail;
+static unsigned int pending;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond;
+
+/* transfers of the commit that's in progress */
+static struct db_transfer **batch;
+
+/* statistics */
+static unsigned long stat_commits, stat_transfers, stat_failed;
+static unsigned int stat_largest;
+
+static void *commit_thread(void *arg)
+{
+	struct commit *commit, *next;
+	struct timespec deadline;
+	sigset_t mask;
+	unsigned int n, i;
+	bool res;
+
+	/* signals are handled by the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&commit_lock);
+	for (;;) {
+		while (!head && running)
+			pthread_cond_wait(&commit_cond, &commit_lock);
+
+		/* commit what's left before stopping */
+		if (!head)
+			break;
+
+		/* give other sessions a chance to join this commit, unless it's full already */
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += window / 1000000;
+		if ((deadline.tv_nsec += (window % 1000000) * 1000) >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (pending < batch_max && running &&
+				pthread_cond_timedwait(&commit_cond, &commit_lock, &deadline) != ETIMEDOUT)
+			;
+
+		/* take the transfers off the queue */
+		commit = head;
+		for (n = 0; head && n < batch_max; head = head->next)
+			batch[n++] = &head->transfer;
+
+		if (!head)
+			tail = NULL;
+		pending -= n;
+		pthread_mutex_unlock(&commit_lock);
+
+		res = db_transfers(batch, n);
+
+		/* and reply to the sessions, a transfer is gone once its session has been woken up */
+		for (i = 0; i < n; i++, commit = next) {
+			next = commit->next;
+			worker_wake(&commit->waiter);
+		}
+
+		pthread_mutex_lock(&commit_lock);
+		stat_commits++;
+		stat_transfers += n;
+		if (n > stat_largest)
+			stat_largest = n;
+		if (!res)
+			stat_failed++;
+	}
+	pthread_mutex_unlock(&commit_lock);
+
+	return NULL;
+}
+
+bool commit_start(unsigned int window_us, unsigned int batch_size)
+{
+	pthread_condattr_t attr;
+
+	/* every transfer is committed on its own */
+	if (!window_us || batch_size < 2)
+		return true;
+
+	window = window_us;
+	batch_max = batch_size;
+
+	if (!(batch = calloc(batch_max, sizeof(struct db_transfer *)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	/* the commit window is measured on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&commit_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	running = true;
+	if (pthread_create(&committer, NULL, commit_thread, NULL)) {
+		iprintf("unable to allocate thread\n");
+		running = false;
+		return false;
+	}
+	enabled = true;
+
+	iprintf(" Committing up to %u transfers at once, waiting up to %u us for them...\n", batch_max, window);
+
+	return true;
+}
+
+void commit_stop(void)
+{
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&commit_lock);
+	running = false;
+	pthread_cond_signal(&commit_cond);
+	pthread_mutex_unlock(&commit_lock);
+
+	pthread_join(committer, NULL);
+	free(batch);
+	batch = NULL;
+	enabled = false;
+}
+
+int commit_transfer(const char *source, const char *dest, int64_t amount)
+{
+	struct commit commit = {
+		.transfer = {
+			.source	= source,
+			.dest	= dest,
+			.amount	= amount,
+			.result	= -1
+		}
+	};
+
+	if (!enabled)
+		return db_transfer(source, dest, amount);
+
+	worker_prepare(&commit.waiter);
+
+	pthread_mutex_lock(&commit_lock);
+	if (!running) {
+		pthread_mutex_unlock(&commit_lock);
+		return db_transfer(source, dest, amount);
+	}
+
+	if (tail)
+		tail->next = &commit;
+	else
+		head = &commit;
+	tail = &commit;
+
+	/* the committer only has to look again when a commit starts or is full */
+	if (++pending == 1 || pending >= batch_max)
+		pthread_cond_signal(&commit_cond);
+	pthread_mutex_unlock(&commit_lock);
+
+	/* the session is parked until its transfer has been committed */
+	worker_sleep(&commit.waiter);
+
+	return commit.transfer.result;
+}
+
+void commit_stats(void)
+{
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&commit_lock);
+	iprintf("Commits: %lu (%lu failed), transfers: %lu (average %.1f, max %u per commit), waiting: %u\n",
+			stat_commits, stat_failed, stat_transfers,
+			stat_commits ? (double) stat_transfers / stat_commits : 0, stat_largest, pending);
+	pthread_mutex_unlock(&commit_lock);
+}
@@ -0,0 +1,869 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <errmsg.h>
+#include <mysqld_error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+static struct db_pool primary, replicas[DB_REPLICAS_MAX];
+static unsigned int nreplicas;
+static atomic_uint next_replica;
+
+/* statistics */
+static atomic_ulong stat_fallbacks;
+
+/* statements prepared on every pooled connection, indexed by stmt_t */
+static const char *statements[STMT_COUNT] = {
+	[STMT_CARD]		= "SELECT `user_id`, `card_id`, `pin`, `attempts`, `iban` FROM `cards` "
+				  "WHERE `iban_key` = ? AND (`iban` = ? OR `iban` LIKE CONCAT(?, '__')) LIMIT 1",
+	[STMT_CARD_SHORT]	= "SELECT `user_id`, `card_id`, `pin`, `attempts`, `iban` FROM `cards` "
+				  "WHERE `iban` = ? OR `iban` LIKE CONCAT(?, '__') LIMIT 1",
+	[STMT_ATTEMPTS_RESET]	= "UPDATE `cards` SET `attempts` = 0 WHERE `iban` = ?",
+	[STMT_ATTEMPTS_INC]	= "UPDATE `cards` SET `attempts` = `attempts` + 1 WHERE `iban` = ?",
+	[STMT_BALANCE]		= "SELECT `balance` FROM `accounts` WHERE `iban` = ?",
+	[STMT_TRANSFER]		= "CALL `transfer`(?, ?, ?)",
+	[STMT_TRANSFER_APPLY]	= "CALL `transfer_apply`(?, ?, ?)",
+	[STMT_USER]		= "SELECT `first_name`, `last_name` FROM `users` WHERE `user_id` = ?",
+	/* both halves are a range scan on their own index, so a page never reads more than 2 pages worth of rows */
+	[STMT_HISTORY]		= "SELECT `transaction_id`, UNIX_TIMESTAMP(`time`), `status`, IFNULL(`source_iban`, ''), "
+				  "IFNULL(`dest_iban`, ''), `amount` FROM ("
+				  "(SELECT * FROM `transactions` WHERE `source_iban` = ? AND `transaction_id` < ? "
+				  "ORDER BY `transaction_id` DESC LIMIT ?) UNION "
+				  "(SELECT * FROM `transactions` WHERE `dest_iban` = ? AND `transaction_id` < ? "
+				  "ORDER BY `transaction_id` DESC LIMIT ?)"
+				  ") AS `history` ORDER BY `transaction_id` DESC LIMIT ?"
+};
+
+static unsigned long long elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+static void db_close(struct db_conn *db)
+{
+	stmt_t i;
+
+	for (i = 0; i < STMT_COUNT; i++) {
+		if (db->stmt[i])
+			mysql_stmt_close(db->stmt[i]);
+		db->stmt[i] = NULL;
+	}
+
+	if (db->sql)
+		mysql_close(db->sql);
+	db->sql = NULL;
+}
+
+/* (re)connect to the database and prepare all statements */
+static bool db_connect(struct db_conn *db)
+{
+	stmt_t i;
+
+	db_close(db);
+
+	if (!(db->sql = mysql_init(NULL))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	/* statements are executed with the non-blocking API, so a request can be parked while waiting for the result */
+	mysql_options(db->sql, MYSQL_OPT_NONBLOCK, 0);
+
+	/* procedures return result sets, affected rows are the rows that matched rather than the ones that changed */
+	if (!mysql_real_connect(db->sql, db->pool->host, sql_user, sql_pass, sql_db, db->pool->port, NULL,
+				CLIENT_MULTI_RESULTS | CLIENT_FOUND_ROWS)) {
+		iprintf("failed to connect to the database on %s: %s\n", db->pool->host, mysql_error(db->sql));
+		goto err;
+	}
+
+	for (i = 0; i < STMT_COUNT; i++) {
+		if (!(db->stmt[i] = mysql_stmt_init(db->sql))) {
+			iprintf("out of memory\n");
+			goto err;
+		}
+
+		if (mysql_stmt_prepare(db->stmt[i], statements[i], strlen(statements[i]))) {
+			iprintf("failed to prepare statement: %s\n", mysql_stmt_error(db->stmt[i]));
+			goto err;
+		}
+	}
+
+	db->checked = time(NULL);
+
+	return true;
+
+err:
+	db_close(db);
+	return false;
+}
+
+/* make sure a connection that hasn't been used for a while is still alive, reconnect if it isn't */
+static bool db_check(struct db_conn *db)
+{
+	time_t now = time(NULL);
+
+	if (db->sql && now - db->checked < DB_PING_INTERVAL)
+		return true;
+
+	if (db->sql && !mysql_ping(db->sql)) {
+		db->checked = now;
+		return true;
+	}
+
+	iprintf("database connection to %s lost, reconnecting\n", db->pool->host);
+
+	pthread_mutex_lock(&db->pool->lock);
+	db->pool->stat_reconnects++;
+	pthread_mutex_unlock(&db->pool->lock);
+
+	return db_connect(db);
+}
+
+/* park the request until the database connection is ready, returns the status to continue the call with */
+static int db_wait(struct db_conn *db, int status)
+{
+	return worker_wait(mysql_get_socket(db->sql), status, mysql_get_timeout_value_ms(db->sql));
+}
+
+/* check if a replica is close enough behind the primary to read from */
+static bool db_lag(struct db_conn *db)
+{
+	static const char query[] = "SHOW SLAVE STATUS";
+	MYSQL_RES *res = NULL;
+	MYSQL_FIELD *fields;
+	MYSQL_ROW row;
+	unsigned int i;
+	int status, err;
+	bool caught_up = false;
+
+	for (status = mysql_real_query_start(&err, db->sql, query, sizeof(query) - 1); status; )
+		status = mysql_real_query_cont(&err, db->sql, db_wait(db, status));
+	if (err)
+		goto err;
+
+	for (status = mysql_store_result_start(&res, db->sql); status; )
+		status = mysql_store_result_cont(&res, db->sql, db_wait(db, status));
+	if (!res)
+		goto err;
+
+	/* a server that isn't replicating at all can't be used either */
+	if (!(row = mysql_fetch_row(res))) {
+		iprintf("%s is not a replica\n", db->pool->host);
+		goto out;
+	}
+
+	fields = mysql_fetch_fields(res);
+	for (i = 0; i < mysql_num_fields(res); i++) {
+		if (strcmp(fields[i].name, "Seconds_Behind_Master") != 0)
+			continue;
+
+		/* NULL if replication has stopped */
+		if (!(caught_up = row[i] && strtol(row[i], NULL, 10) <= DB_LAG_MAX))
+			dprintf("replica %s is lagging behind: %s seconds\n", db->pool->host, row[i] ? row[i] : "NULL");
+		break;
+	}
+
+out:
+	mysql_free_result(res);
+
+	return caught_up;
+
+err:
+	iprintf("unable to check the replication lag of %s: %s\n", db->pool->host, mysql_error(db->sql));
+	mysql_free_result(res);
+
+	return false;
+}
+
+static bool pool_start(struct db_pool *pool, const char *host, uint16_t port, unsigned int size, bool replica)
+{
+	unsigned int i;
+
+	pool->host = host;
+	pool->port = port;
+	pool->replica = replica;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	if (!(pool->conns = calloc(size, sizeof(struct db_conn)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+	pool->size = size;
+
+	for (i = 0; i < size; i++) {
+		pool->conns[i].pool = pool;
+
+		/* an unreachable replica isn't fatal, its connections are reconnected when it's tried again */
+		if (!pool->avoid_until && !db_connect(&pool->conns[i])) {
+			if (!replica)
+				return false;
+
+			pool->avoid_until = time(NULL) + DB_PING_INTERVAL;
+		}
+
+		pool->conns[i].next = pool->idle;
+		pool->idle = &pool->conns[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &pool->stat_start);
+
+	return true;
+}
+
+static void pool_stop(struct db_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->size; i++)
+		db_close(&pool->conns[i]);
+
+	free(pool->conns);
+	pool->conns = pool->idle = NULL;
+	pool->size = 0;
+}
+
+static struct db_conn *pool_acquire(struct db_pool *pool)
+{
+	struct db_conn *db;
+	struct db_waiter waiter;
+	struct timespec start, end;
+	unsigned long long wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->idle) {
+		db = pool->idle;
+		pool->idle = db->next;
+		if (++pool->busy > pool->peak)
+			pool->peak = pool->busy;
+	} else {
+		/* requests parked on the same worker may be holding the connections, so park until one is handed over */
+		pool->stat_waited++;
+		worker_prepare(&waiter.waiter);
+		waiter.db = NULL;
+		waiter.next = NULL;
+		if (pool->waiting_tail)
+			pool->waiting_tail->next = &waiter;
+		else
+			pool->waiting = &waiter;
+		pool->waiting_tail = &waiter;
+		pthread_mutex_unlock(&pool->lock);
+
+		worker_sleep(&waiter.waiter);
+
+		pthread_mutex_lock(&pool->lock);
+		db = waiter.db;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wait = elapsed(&start, &end);
+	pool->stat_acquired++;
+	pool->stat_wait += wait;
+	if (wait > pool->stat_wait_max)
+		pool->stat_wait_max = wait;
+	pthread_mutex_unlock(&pool->lock);
+
+	db->acquired = end;
+
+	if (!db_check(db)) {
+		db_release(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+/* borrow a connection from a replica, NULL if it's unreachable or lagging (or known to be) */
+static struct db_conn *replica_acquire(struct db_pool *pool, time_t now)
+{
+	struct db_conn *db;
+	bool check;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->avoid_until > now) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	/* only one request checks the lag at a time */
+	if ((check = now - pool->lag_checked >= DB_LAG_INTERVAL))
+		pool->lag_checked = now;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!(db = pool_acquire(pool))) {
+		pthread_mutex_lock(&pool->lock);
+		pool->avoid_until = now + DB_PING_INTERVAL;
+		pthread_mutex_unlock(&pool->lock);
+
+		return NULL;
+	}
+
+	if (check && !db_lag(db)) {
+		db_release(db);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->avoid_until = now + DB_LAG_INTERVAL;
+		pthread_mutex_unlock(&pool->lock);
+
+		return NULL;
+	}
+
+	return db;
+}
+
+bool db_start(unsigned int size)
+{
+	iprintf(" Connecting to the database (%u connections)...\n", size);
+	if (!pool_start(&primary, sql_host, sql_port, size, false))
+		return false;
+
+	for (nreplicas = 0; nreplicas < replica_count; nreplicas++) {
+		iprintf(" Connecting to replica %s (%u connections)...\n", replica_hosts[nreplicas], size);
+		if (!pool_start(&replicas[nreplicas], replica_hosts[nreplicas], replica_ports[nreplicas], size, true))
+			return false;
+	}
+
+	return true;
+}
+
+void db_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nreplicas; i++)
+		pool_stop(&replicas[i]);
+	nreplicas = 0;
+
+	pool_stop(&primary);
+}
+
+struct db_conn *db_acquire(bool replica)
+{
+	struct db_conn *db;
+	unsigned int i;
+	time_t now;
+
+	if (!replica || !nreplicas)
+		return pool_acquire(&primary);
+
+	/* spread the reads over the replicas, skipping the ones that can't be used right now */
+	now = time(NULL);
+	for (i = 0; i < nreplicas; i++) {
+		if ((db = replica_acquire(&replicas[next_replica++ % nreplicas], now)))
+			return db;
+	}
+
+	stat_fallbacks++;
+
+	return pool_acquire(&primary);
+}
+
+void db_release(struct db_conn *db)
+{
+	struct db_pool *pool = db->pool;
+	struct db_waiter *waiter;
+	struct timespec now;
+
+	/* check the connection the next time it's used if the server went away */
+	if (db->sql && (mysql_errno(db->sql) == CR_SERVER_GONE_ERROR || mysql_errno(db->sql) == CR_SERVER_LOST))
+		db->checked = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stat_busy += elapsed(&db->acquired, &now);
+
+	/* hand the connection straight to the oldest waiting request, it stays busy */
+	if ((waiter = pool->waiting)) {
+		if (!(pool->waiting = waiter->next))
+			pool->waiting_tail = NULL;
+		waiter->db = db;
+		pthread_mutex_unlock(&pool->lock);
+
+		/* the waiter may be gone once it's woken up */
+		worker_wake(&waiter->waiter);
+		return;
+	}
+
+	db->next = pool->idle;
+	pool->idle = db;
+	pool->busy--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_stats(struct db_pool *pool)
+{
+	struct timespec now;
+	unsigned long long total;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	total = elapsed(&pool->stat_start, &now) * pool->size;
+
+	pthread_mutex_lock(&pool->lock);
+	iprintf("Database %s%s: %u/%u connections in use (peak %u), utilization %.1f%%, acquired: %lu, waited: %lu "
+			"(average %.3f ms, max %.3f ms), reconnects: %lu\n", pool->host, pool->replica ? " (replica)" : "",
+			pool->busy, pool->size, pool->peak, total ? 100.0 * pool->stat_busy / total : 0,
+			pool->stat_acquired, pool->stat_waited,
+			pool->stat_acquired ? pool->stat_wait / 1e6 / pool->stat_acquired : 0,
+			pool->stat_wait_max / 1e6, pool->stat_reconnects);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void db_stats(void)
+{
+	unsigned int i;
+
+	pool_stats(&primary);
+	for (i = 0; i < nreplicas; i++)
+		pool_stats(&replicas[i]);
+
+	if (nreplicas)
+		iprintf("Database: %lu reads fell back to the primary\n", (unsigned long) stat_fallbacks);
+}
+
+/* fill in a parameter or result binding */
+static void db_bind(MYSQL_BIND *bind, enum enum_field_types type, void *buf, unsigned long size, unsigned long *len,
+		bool is_unsigned)
+{
+	memset(bind, 0, sizeof(MYSQL_BIND));
+	bind->buffer_type = type;
+	bind->buffer = buf;
+	bind->buffer_length = size;
+	bind->length = len;
+	bind->is_unsigned = is_unsigned;
+}
+
+/* execute a prepared statement on a borrowed connection, returns the number of affected rows or -1 on error */
+static int db_execute(struct db_conn *db, MYSQL_STMT *stmt, MYSQL_BIND *params)
+{
+	int err, status;
+
+	if (mysql_stmt_bind_param(stmt, params))
+		goto err;
+
+	for (status = mysql_stmt_execute_start(&err, stmt); status; )
+		status = mysql_stmt_execute_cont(&err, stmt, db_wait(db, status));
+	if (err)
+		goto err;
+
+	return mysql_stmt_affected_rows(stmt);
+
+err:
+	iprintf("error executing statement: %s\n", mysql_stmt_error(stmt));
+
+	return -1;
+}
+
+/* fetch the next row into the result bindings, returns 1 if there was one, 0 if there wasn't and -1 on error */
+static int db_fetch(struct db_conn *db, MYSQL_STMT *stmt)
+{
+	int err, status;
+
+	/* truncated columns are still a row, their lengths are checked by the caller */
+	for (status = mysql_stmt_fetch_start(&err, stmt); status; )
+		status = mysql_stmt_fetch_cont(&err, stmt, db_wait(db, status));
+
+	switch (err) {
+	case 0:
+	case MYSQL_DATA_TRUNCATED:
+		return 1;
+	case MYSQL_NO_DATA:
+		return 0;
+	default:
+		iprintf("error fetching statement result: %s\n", mysql_stmt_error(stmt));
+		return -1;
+	}
+}
+
+/* read the rest of the results of a statement so the connection can be reused */
+static bool db_finish(struct db_conn *db, MYSQL_STMT *stmt)
+{
+	my_bool freed;
+	int err, status;
+
+	for (status = mysql_stmt_free_result_start(&freed, stmt); status; )
+		status = mysql_stmt_free_result_cont(&freed, stmt, db_wait(db, status));
+
+	/* a CALL is followed by the status of the procedure itself */
+	while (mysql_stmt_more_results(stmt)) {
+		for (status = mysql_stmt_next_result_start(&err, stmt); status; )
+			status = mysql_stmt_next_result_cont(&err, stmt, db_wait(db, status));
+
+		if (err > 0) {
+			iprintf("error reading statement result: %s\n", mysql_stmt_error(stmt));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * execute a prepared statement on a borrowed connection
+ * with result bindings at most 1 row is fetched and the number of rows (0 or 1) is returned, otherwise the number of
+ * affected rows is returned
+ */
+static int db_run(struct db_conn *db, stmt_t type, MYSQL_BIND *params, MYSQL_BIND *results)
+{
+	MYSQL_STMT *stmt;
+	int res;
+
+	if (!(stmt = db->stmt[type])) {
+		iprintf("statement %d isn't prepared\n", type);
+		return -1;
+	}
+
+	if ((res = db_execute(db, stmt, params)) < 0 || !results)
+		return res;
+
+	if (mysql_stmt_bind_result(stmt, results)) {
+		iprintf("error binding statement result: %s\n", mysql_stmt_error(stmt));
+		res = -1;
+	} else {
+		res = db_fetch(db, stmt);
+	}
+
+	if (!db_finish(db, stmt))
+		res = -1;
+
+	return res;
+}
+
+/* execute a prepared statement on a connection borrowed for just this statement (see db_run()) */
+static int db_exec(stmt_t type, MYSQL_BIND *params, MYSQL_BIND *results, bool replica)
+{
+	struct db_conn *db;
+	int res;
+
+	/* reads that don't have to see the latest writes may go to a replica */
+	if (!(db = db_acquire(replica)))
+		return -1;
+
+	res = db_run(db, type, params, results);
+	db_release(db);
+
+	return res;
+}
+
+/* run a statement without parameters or results, such as transaction control */
+static bool db_query(struct db_conn *db, const char *query)
+{
+	int status, err;
+
+	for (status = mysql_real_query_start(&err, db->sql, query, strlen(query)); status; )
+		status = mysql_real_query_cont(&err, db->sql, db_wait(db, status));
+
+	if (err)
+		iprintf("error running query: %s\n", mysql_error(db->sql));
+
+	return !err;
+}
+
+int db_card(const char *iban, struct db_card *card)
+{
+	MYSQL_BIND params[3], results[5];
+	unsigned long iban_len = strlen(iban), key_len, id_len, pin_len, card_iban_len;
+	char id[13];
+	int res;
+
+	/*
+	 * a full IBAN and the same IBAN without its last 2 characters have the same indexed lookup key, the rest of the
+	 * match is checked per row. The key isn't known if the IBAN that's looked up is shorter than the key itself.
+	 */
+	key_len = DB_IBAN_KEY_LEN;
+
+	db_bind(&params[0], MYSQL_TYPE_STRING, (char *) iban, key_len, &key_len, false);
+	db_bind(&params[1], MYSQL_TYPE_STRING, (char *) iban, iban_len, &iban_len, false);
+	db_bind(&params[2], MYSQL_TYPE_STRING, (char *) iban, iban_len, &iban_len, false);
+
+	db_bind(&results[0], MYSQL_TYPE_LONG, &card->user_id, 0, NULL, true);
+	db_bind(&results[1], MYSQL_TYPE_STRING, id, sizeof(id) - 1, &id_len, false);
+	db_bind(&results[2], MYSQL_TYPE_STRING, card->pin, DB_PIN_MAX, &pin_len, false);
+	db_bind(&results[3], MYSQL_TYPE_LONG, &card->attempts, 0, NULL, true);
+	db_bind(&results[4], MYSQL_TYPE_STRING, card->iban, HBP_IBAN_MAX, &card_iban_len, false);
+
+	if (iban_len >= DB_IBAN_KEY_LEN)
+		res = db_exec(STMT_CARD, params, results, false);
+	else
+		res = db_exec(STMT_CARD_SHORT, params + 1, results, false);
+	if (res <= 0)
+		return res;
+
+	if (id_len >= sizeof(id) || pin_len > DB_PIN_MAX || card_iban_len > HBP_IBAN_MAX) {
+		iprintf("card %s has malformed data\n", iban);
+		return -1;
+	}
+
+	id[id_len] = '\0';
+	card->pin[pin_len] = '\0';
+	card->iban[card_iban_len] = '\0';
+	card->card_id = strtol(id, NULL, 10);
+
+	return 1;
+}
+
+bool db_attempts(const char *iban, bool reset)
+{
+	MYSQL_BIND params[1];
+	unsigned long iban_len = strlen(iban);
+
+	db_bind(&params[0], MYSQL_TYPE_STRING, (char *) iban, iban_len, &iban_len, false);
+
+	return db_exec(reset ? STMT_ATTEMPTS_RESET : STMT_ATTEMPTS_INC, params, NULL, false) >= 0;
+}
+
+int db_balance(const char *iban, int64_t *balance, bool replica)
+{
+	MYSQL_BIND params[1], results[1];
+	unsigned long iban_len = strlen(iban);
+
+	db_bind(&params[0], MYSQL_TYPE_STRING, (char *) iban, iban_len, &iban_len, false);
+	db_bind(&results[0], MYSQL_TYPE_LONGLONG, balance, 0, NULL, false);
+
+	return db_exec(STMT_BALANCE, params, results, replica);
+}
+
+int db_transfer(const char *source, const char *dest, int64_t amount)
+{
+	MYSQL_BIND params[3], results[1];
+	unsigned long source_len = strlen(source), dest_len = strlen(dest);
+	int32_t result;
+
+	db_bind(&params[0], MYSQL_TYPE_STRING, (char *) source, source_len, &source_len, false);
+	db_bind(&params[1], MYSQL_TYPE_STRING, (char *) dest, dest_len, &dest_len, false);
+	db_bind(&params[2], MYSQL_TYPE_LONGLONG, &amount, 0, NULL, false);
+	db_bind(&results[0], MYSQL_TYPE_LONG, &result, 0, NULL, false);
+
+	/* the procedure always returns a row, unless it failed */
+	if (db_exec(STMT_TRANSFER, params, results, false) <= 0)
+		return -1;
+
+	return result ? 1 : 0;
+}
+
+bool db_transfers(struct db_transfer **transfers, unsigned int count)
+{
+	struct db_conn *db;
+	MYSQL_BIND params[3], results[1];
+	unsigned long source_len, dest_len;
+	unsigned int i, err;
+	int32_t result;
+
+	if (!(db = db_acquire(false)))
+		goto err;
+
+	if (!db_query(db, "START TRANSACTION"))
+		goto err_release;
+
+	db_bind(&params[0], MYSQL_TYPE_STRING, NULL, 0, &source_len, false);
+	db_bind(&params[1], MYSQL_TYPE_STRING, NULL, 0, &dest_len, false);
+	db_bind(&params[2], MYSQL_TYPE_LONGLONG, NULL, 0, NULL, false);
+	db_bind(&results[0], MYSQL_TYPE_LONG, &result, 0, NULL, false);
+
+	for (i = 0; i < count; i++) {
+		params[0].buffer = (char *) transfers[i]->source;
+		params[0].buffer_length = source_len = strlen(transfers[i]->source);
+		params[1].buffer = (char *) transfers[i]->dest;
+		params[1].buffer_length = dest_len = strlen(transfers[i]->dest);
+		params[2].buffer = &transfers[i]->amount;
+
+		/* a transfer that fails is rolled back on its own by the procedure */
+		if (db_run(db, STMT_TRANSFER_APPLY, params, results) > 0) {
+			transfers[i]->result = result ? 1 : 0;
+			continue;
+		}
+		transfers[i]->result = -1;
+
+		/* unless the whole transaction has been rolled back or the connection has been lost */
+		err = mysql_stmt_errno(db->stmt[STMT_TRANSFER_APPLY]);
+		if (err == ER_LOCK_DEADLOCK || err == ER_LOCK_WAIT_TIMEOUT || err == CR_SERVER_GONE_ERROR ||
+				err == CR_SERVER_LOST)
+			goto err_rollback;
+	}
+
+	if (!db_query(db, "COMMIT"))
+		goto err_rollback;
+
+	db_release(db);
+
+	return true;
+
+err_rollback:
+	db_query(db, "ROLLBACK");
+err_release:
+	db_release(db);
+err:
+	for (i = 0; i < count; i++)
+		transfers[i]->result = -1;
+
+	return false;
+}
+
+bool db_history(const struct history_record *records, unsigned int count)
+{
+	static const char insert[] = "INSERT INTO `transactions` (`status`, `time`, `source_iban`, `dest_iban`, `amount`) "
+			"VALUES ";
+	struct db_conn *db;
+	char *query, *p;
+	unsigned int i;
+	bool res = false;
+
+	/* every row has at most 2 escaped IBANs and a few numbers */
+	if (!(query = malloc(sizeof(insert) + count * (4 * (HBP_IBAN_MAX + 1) + 128)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	/* escaping depends on the character set of the connection */
+	if (!(db = db_acquire(false)))
+		goto err;
+
+	p = stpcpy(query, insert);
+	for (i = 0; i < count; i++) {
+		p += sprintf(p, "%s(%u, FROM_UNIXTIME(%lld), '", i ? ", " : "", records[i].status,
+				(long long) records[i].time);
+		p += mysql_real_escape_string(db->sql, p, records[i].source, strlen(records[i].source));
+
+		if (records[i].dest[0]) {
+			p = stpcpy(p, "', '");
+			p += mysql_real_escape_string(db->sql, p, records[i].dest, strlen(records[i].dest));
+			p = stpcpy(p, "', ");
+		} else {
+			p = stpcpy(p, "', NULL, ");
+		}
+
+		p += sprintf(p, "%lld)", (long long) records[i].amount);
+	}
+
+	res = db_query(db, query);
+	db_release(db);
+
+err:
+	free(query);
+
+	return res;
+}
+
+int db_user(uint32_t user_id, char *first_name, char *last_name, bool replica)
+{
+	MYSQL_BIND params[1], results[2];
+	unsigned long first_len, last_len;
+	int res;
+
+	db_bind(&params[0], MYSQL_TYPE_LONG, &user_id, 0, NULL, true);
+	db_bind(&results[0], MYSQL_TYPE_STRING, first_name, DB_NAME_MAX, &first_len, false);
+	db_bind(&results[1], MYSQL_TYPE_STRING, last_name, DB_NAME_MAX, &last_len, false);
+
+	if ((res = db_exec(STMT_USER, params, results, replica)) <= 0)
+		return res;
+
+	/* names are truncated rather than rejected */
+	first_name[first_len < DB_NAME_MAX ? first_len : DB_NAME_MAX] = '\0';
+	last_name[last_len < DB_NAME_MAX ? last_len : DB_NAME_MAX] = '\0';
+
+	return 1;
+}
+
+int db_transactions(const char *iban, uint64_t cursor, struct db_transaction *transactions, unsigned int max,
+		bool replica)
+{
+	struct db_conn *db;
+	struct db_transaction row;
+	MYSQL_BIND params[7], results[6];
+	MYSQL_STMT *stmt;
+	unsigned long iban_len = strlen(iban), source_len, dest_len;
+	unsigned int n = 0;
+	int res = 0;
+
+	/* a cursor of 0 starts at the most recent transaction */
+	if (!cursor)
+		cursor = UINT64_MAX;
+
+	db_bind(&params[0], MYSQL_TYPE_STRING, (char *) iban, iban_len, &iban_len, false);
+	db_bind(&params[1], MYSQL_TYPE_LONGLONG, &cursor, 0, NULL, true);
+	db_bind(&params[2], MYSQL_TYPE_LONG, &max, 0, NULL, true);
+	db_bind(&params[3], MYSQL_TYPE_STRING, (char *) iban, iban_len, &iban_len, false);
+	db_bind(&params[4], MYSQL_TYPE_LONGLONG, &cursor, 0, NULL, true);
+	db_bind(&params[5], MYSQL_TYPE_LONG, &max, 0, NULL, true);
+	db_bind(&params[6], MYSQL_TYPE_LONG, &max, 0, NULL, true);
+
+	db_bind(&results[0], MYSQL_TYPE_LONGLONG, &row.id, 0, NULL, true);
+	db_bind(&results[1], MYSQL_TYPE_LONGLONG, &row.time, 0, NULL, false);
+	db_bind(&results[2], MYSQL_TYPE_TINY, &row.status, 0, NULL, true);
+	db_bind(&results[3], MYSQL_TYPE_STRING, row.source, HBP_IBAN_MAX + 1, &source_len, false);
+	db_bind(&results[4], MYSQL_TYPE_STRING, row.dest, HBP_IBAN_MAX + 1, &dest_len, false);
+	db_bind(&results[5], MYSQL_TYPE_LONGLONG, &row.amount, 0, NULL, false);
+
+	if (!(db = db_acquire(replica)))
+		return -1;
+
+	if (!(stmt = db->stmt[STMT_HISTORY])) {
+		iprintf("statement %d isn't prepared\n", STMT_HISTORY);
+		goto err;
+	}
+
+	if (db_execute(db, stmt, params) < 0)
+		goto err;
+
+	if (mysql_stmt_bind_result(stmt, results)) {
+		iprintf("error binding statement result: %s\n", mysql_stmt_error(stmt));
+		goto err_finish;
+	}
+
+	while (n < max && (res = db_fetch(db, stmt)) > 0) {
+		/* the columns are at most as long as an IBAN */
+		if (source_len > HBP_IBAN_MAX || dest_len > HBP_IBAN_MAX)
+			continue;
+		row.source[source_len] = '\0';
+		row.dest[dest_len] = '\0';
+
+		transactions[n++] = row;
+	}
+	if (res < 0)
+		goto err_finish;
+
+	if (!db_finish(db, stmt))
+		goto err;
+
+	db_release(db);
+
+	return n;
+
+err_finish:
+	db_finish(db, stmt);
+err:
+	db_release(db);
+
+	return -1;
+}
@@ -30,7 +30,9 @@
 #include <stdint.h>
 
 /** @brief Version of the HBP protocol */
-#define HBP_VERSION	2
+#define HBP_VERSION	3
+/** @brief Oldest version of the HBP protocol that is still accepted */
+#define HBP_VERSION_MIN	2
 /** @brief Magic number */
 #define HBP_MAGIC	0x4B9A208E
 /** @brief Default port on which hb-server is hosted */
@@ -54,12 +56,25 @@
 #define HBP_TIMEOUT	(5 * 60)
 /** @brief Card ID length in bytes */
 #define HBP_CID_MAX	12
+/** @brief Maximum number of sub-requests in a #HBP_REQ_BATCH request */
+#define HBP_BATCH_MAX	8
+/** @brief Maximum number of transactions in a #HBP_REP_HISTORY reply */
+#define HBP_HISTORY_MAX	15
 
 /**
  * @brief Request and reply header
  *
  * This structure leads the msgpack data and specifies the version of HBP used (to check compatiblity), the size of the
  * following data and the type of request/reply.
+ *
+ * Since HBP v3 the header also contains a request ID chosen by the client. A client may send multiple requests without
+ * waiting for the replies (pipelining). Every reply carries the ID of the request it belongs to and replies may be sent
+ * in a different order than the requests were received in, so clients must match replies to requests by their ID.
+ * Requests that depend on each other (e.g. #HBP_REQ_INFO after #HBP_REQ_LOGIN) are always handled in the order they
+ * were sent in.
+ *
+ * HBP v2 clients send and receive the header without the request ID (see #HBP_HEADER_SIZE). They receive their replies
+ * in the same order as their requests.
  */
 struct hbp_header {
 	/** @brief Magic number (see #HBP_MAGIC) */
@@ -70,8 +85,15 @@ struct hbp_header {
 	uint8_t		type;
 	/** @brief Length of the following msgpack data (may not exceed #HBP_LENGTH_MAX bytes) */
 	uint16_t	length;
+	/** @brief Request ID, the reply to a request carries the same ID (HBP v3 and up) */
+	uint32_t	id;
 } __attribute__((packed));
 
+/** @brief Size of the header used by HBP v2 (without the request ID) */
+#define HBP_HEADER_V2_SIZE	8
+/** @brief Size of the header used by the specified version of HBP */
+#define HBP_HEADER_SIZE(version) ((version) >= 3 ? sizeof(struct hbp_header) : HBP_HEADER_V2_SIZE)
+
 static const struct {
 	int index;
 	const char *name;
@@ -82,6 +104,8 @@ static const struct {
 	{ 2, "INFO" },
 	{ 3, "BALANCE" },
 	{ 4, "TRANSFER" },
+	{ 5, "BATCH" },
+	{ 6, "HISTORY" },
 
 	/* replies */
 	{ 128, "LOGIN" },
@@ -90,6 +114,8 @@ static const struct {
 	{ 131, "BALANCE" },
 	{ 132, "TRANSFER" },
 	{ 133, "ERROR" },
+	{ 134, "BATCH" },
+	{ 135, "HISTORY" },
 
 	{ -1, NULL }
 };
@@ -163,7 +189,40 @@ typedef enum {
 	 * @sa The reply associated with this request: #HBP_REP_TRANSFER
 	 * @sa An enumeration of parameters: #hbp_req_transfer_params_t
 	 */
-	HBP_REQ_TRANSFER
+	HBP_REQ_TRANSFER,
+
+	/**
+	 * @brief Request to handle multiple requests at once
+	 *
+	 * Handles up to #HBP_BATCH_MAX sub-requests in order, as if they were sent separately, and returns all of the
+	 * replies at once. This saves a round trip for every sub-request, e.g. #HBP_REQ_LOGIN followed by #HBP_REQ_INFO and
+	 * #HBP_REQ_BALANCE.
+	 *
+	 * Handling stops at the first sub-request that fails, which gets #HBP_REP_ERROR as its reply. The sub-requests
+	 * after it are not handled and get no reply. Batches can't be nested.
+	 *
+	 * @param requests (array) The sub-requests, every sub-request being an array of its type (int, see
+	 * #hbp_request_t) and its parameters (the parameters the request would normally have or nil if it has none)
+	 *
+	 * @sa The reply associated with this request: #HBP_REP_BATCH
+	 */
+	HBP_REQ_BATCH,
+
+	/**
+	 * @brief Request for the most recent transactions of the account associated with the current session
+	 *
+	 * Returns up to #HBP_HISTORY_MAX transactions at a time, most recent first. The first page is requested with
+	 * cursor 0, the following pages with the cursor returned in the previous reply.
+	 *
+	 * Only available for local accounts. Can't be part of a #HBP_REQ_BATCH request as the reply can take up all of
+	 * #HBP_LENGTH_MAX bytes.
+	 *
+	 * @param cursor (uint) 0 for the most recent transactions or the cursor from the previous #HBP_REP_HISTORY reply
+	 *
+	 * @sa The reply associated with this request: #HBP_REP_HISTORY
+	 * @sa An enumeration of parameters: #hbp_req_history_params_t
+	 */
+	HBP_REQ_HISTORY
 } hbp_request_t;
 
 /** @brief Parameters included in #HBP_REQ_LOGIN */
@@ -181,6 +240,12 @@ typedef enum {
 	HBP_REQ_TRANSFER_LENGTH
 } hbp_req_transfer_params_t;
 
+/** @brief Parameters included in #HBP_REQ_HISTORY */
+typedef enum {
+	HBP_REQ_HISTORY_CURSOR,
+	HBP_REQ_HISTORY_LENGTH
+} hbp_req_history_params_t;
+
 /**
  * @brief Types of replies
  */
@@ -250,7 +315,36 @@ typedef enum {
 	 * - The server is out of memory
 	 * - An invalid request has been received
 	 */
-	HBP_REP_ERROR
+	HBP_REP_ERROR,
+
+	/**
+	 * @brief Reply to a request to handle multiple requests at once
+	 *
+	 * @param replies (array) The replies to the sub-requests that have been handled, in the same order as the
+	 * sub-requests. Every reply is an array of its type (int, see #hbp_reply_t) and its parameters (nil for
+	 * #HBP_REP_ERROR).
+	 *
+	 * @sa The request associated with this reply: #HBP_REQ_BATCH
+	 */
+	HBP_REP_BATCH,
+
+	/**
+	 * @brief Reply to a request for the most recent transactions of the account associated with the current session
+	 *
+	 * Every transaction is an array of its parameters (see #hbp_rep_history_transaction_params_t):
+	 * - id (uint) Transaction ID
+	 * - time (int) Time of the transaction (UNIX timestamp)
+	 * - iban (string) IBAN of the other account, empty for a withdrawal and this account's IBAN for a deposit
+	 * - amount (int) Amount in Eurocents, negative if it has been transferred from this account
+	 * - status (int) See #hbp_rep_transfer_result_t
+	 *
+	 * @param transactions (array) Up to #HBP_HISTORY_MAX transactions, most recent first
+	 * @param cursor (uint) Cursor for the next page, 0 if there are no older transactions
+	 *
+	 * @sa The request associated with this reply: #HBP_REQ_HISTORY
+	 * @sa An enumeration of parameters: #hbp_rep_history_params_t
+	 */
+	HBP_REP_HISTORY
 } hbp_reply_t;
 
 /** @brief Parameters included in #HBP_REP_INFO */
@@ -260,6 +354,23 @@ typedef enum {
 	HBP_REP_INFO_LENGTH
 } hbp_rep_info_params_t;
 
+/** @brief Parameters included in #HBP_REP_HISTORY */
+typedef enum {
+	HBP_REP_HISTORY_TRANSACTIONS,
+	HBP_REP_HISTORY_CURSOR,
+	HBP_REP_HISTORY_LENGTH
+} hbp_rep_history_params_t;
+
+/** @brief Parameters of every transaction in #HBP_REP_HISTORY */
+typedef enum {
+	HBP_REP_HISTORY_ID,
+	HBP_REP_HISTORY_TIME,
+	HBP_REP_HISTORY_IBAN,
+	HBP_REP_HISTORY_AMOUNT,
+	HBP_REP_HISTORY_STATUS,
+	HBP_REP_HISTORY_TRANSACTION_LENGTH
+} hbp_rep_history_transaction_params_t;
+
 /** @brief Indicates whether the login failed or succeeded in #HBP_REP_LOGIN */
 typedef enum {
 	/** The login was successful */
@@ -27,20 +27,119 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include <ucontext.h>
 
 #include <openssl/ssl.h>
 #include <netinet/in.h>
 
-#include <mysql.h>
+#if SQLITE
+#  include <sqlite3.h>
+#else
+#  include <mysql.h>
+#endif
 #include <msgpack.h>
 
+#include "journal.h"
+
+#if SQLITE
+/* workers wait for file descriptors using the same flags as the non-blocking MariaDB API */
+#  define MYSQL_WAIT_READ	1
+#  define MYSQL_WAIT_WRITE	2
+#  define MYSQL_WAIT_EXCEPT	4
+#  define MYSQL_WAIT_TIMEOUT	8
+#endif
+
+/** @brief Maximum number of events to retrieve per call to epoll_wait(2) */
+#define REACTOR_EVENTS_MAX	256
+/** @brief Size of the input buffer of a connection in bytes (must be a power of 2 and fit at least 1 request) */
+#define CONN_INBUF_SIZE		4096
+/** @brief Size of the output buffer of a connection in bytes (must fit at least 1 reply) */
+#define CONN_OUTBUF_SIZE	4096
+/** @brief Default number of worker threads */
+#define WORKERS_DEFAULT		8
+/** @brief Default maximum number of requests waiting for a worker */
+#define QUEUE_DEFAULT		256
+/** @brief Default maximum number of connections per acceptor when using io_uring */
+#define CONNECTIONS_DEFAULT	1024
+/**
+ * @brief Maximum number of requests a worker keeps in flight while they're waiting for the database
+ *
+ * Only waits that park the request (database queries and worker_run() calls) let the other requests on the same
+ * worker continue, anything else a request does blocks them all.
+ */
+#define WORKER_FIBERS		16
+/** @brief Size of the stack of every request in flight in bytes */
+#define WORKER_STACK_SIZE	(256 * 1024)
+/** @brief Number of threads blocking calls are handed to (see worker_run()), such as PIN hashing and NOOB requests */
+#define WORKER_BLOCKING		4
+/** @brief Default number of database connections */
+#define DB_POOL_DEFAULT		8
+/** @brief Number of seconds a database connection may be idle before it's checked again before use */
+#define DB_PING_INTERVAL	30
+/** @brief Default SQLite database file */
+#define DB_SQLITE_DEFAULT	"herbank.db"
+/** @brief Maximum time to wait for another SQLite connection to finish writing in milliseconds */
+#define DB_SQLITE_BUSY_TIMEOUT	5000
+/** @brief Maximum number of transactions waiting to be written to the database */
+#define HISTORY_QUEUE_SIZE	4096
+/** @brief Maximum number of transactions written to the database in a single INSERT */
+#define HISTORY_BATCH		256
+/** @brief Interval at which waiting transactions are written to the database in milliseconds */
+#define HISTORY_INTERVAL	100
+/** @brief Default file to keep transactions in while the database is unavailable */
+#define HISTORY_SPILL_DEFAULT	"hb-history.spill"
+/** @brief Default maximum number of transfers committed together */
+#define COMMIT_BATCH_DEFAULT	64
+/** @brief Maximum number of database replicas reads can be routed to */
+#define DB_REPLICAS_MAX		8
+/** @brief Number of seconds a session reads from the primary after writing to it, so it sees its own writes */
+#define DB_STICKY_INTERVAL	5
+/** @brief Interval at which the replication lag of a replica is checked in seconds */
+#define DB_LAG_INTERVAL		1
+/** @brief Maximum replication lag of a replica in seconds, reads go to the primary if it's lagging further behind */
+#define DB_LAG_MAX		2
+/** @brief Maximum length of a log message in bytes, longer messages are truncated */
+#define LOG_LINE_MAX		256
+/** @brief Number of log messages a thread can have waiting to be written (must be a power of 2) */
+#define LOG_RING_SIZE		1024
+/** @brief Size of the buffers log messages are collected in before they're written in bytes */
+#define LOG_BUF_SIZE		16384
+/** @brief Interval at which the log writer checks for new messages when idle in milliseconds */
+#define LOG_INTERVAL		10
+
+/**
+ * @brief Event loop information
+ *
+ * Every event loop accepts clients on its own listening socket and drives the connections it has accepted.
+ */
+struct reactor {
+	/** Thread running this event loop */
+	pthread_t	thread;
+	/** Index of this event loop */
+	unsigned int	id;
+	/** Listening socket */
+	int		sock;
+	/** epoll(7) instance */
+	int		epfd;
+};
+
+/** @brief State of a client connection in the event loop */
+typedef enum {
+	/** The TLS/SSL handshake has not been completed yet */
+	CONN_HANDSHAKE,
+	/** The connection has been established and requests can be received */
+	CONN_ACTIVE
+} conn_state_t;
+
 /**
  * @brief Connection information
  *
- * A new instance of struct token is created for every client that connects and successfully logs in.
+ * A new instance of struct connection is created for every client that connects.
  * The information in this struct is only used internally and not available or sent to the client at any moment.
  */
 struct connection {
@@ -48,16 +147,43 @@ struct connection {
 	int		socket;
 	/** Client IP address */
 	char		host[INET6_ADDRSTRLEN];
-	/** MySQL database connection */
-	MYSQL		*sql;
+	/** Event loop this connection belongs to */
+	struct reactor	*reactor;
 #if SSLSOCK
 	/** TLS/SSL connection information */
 	SSL		*ssl;
+	/** Set if TLS/SSL has to write to the socket before it can continue */
+	bool		want_write;
 #endif
 	int		errcnt;
+	conn_state_t	state;
+
+	/** Ring buffer containing the data received from the client */
+	char		inbuf[CONN_INBUF_SIZE];
+	/** Position (modulo #CONN_INBUF_SIZE) up to which inbuf has been filled */
+	uint32_t	inhead;
+	/** Position (modulo #CONN_INBUF_SIZE) of the first request in inbuf that hasn't been taken out yet */
+	uint32_t	intail;
+
+	/** Header of the request that is currently being handled */
+	struct hbp_header request;
+	/** Data of the request that is currently being handled, points to inbuf or request_data */
+	const char	*request_ptr;
+	/** Copy of the request data if it wraps around the end of inbuf */
+	char		request_data[HBP_LENGTH_MAX];
+
+	/** Replies that haven't been sent to the client yet */
+	char		outbuf[CONN_OUTBUF_SIZE];
+	/** Number of bytes in outbuf */
+	size_t		outlen;
+
+	/** Next connection waiting for a worker */
+	struct connection *next;
 
 	bool		logged_in;
 	time_t		expiry_time;
+	/** Reads go to the primary database until this time, so this session sees its own writes */
+	time_t		primary_until;
 	char		iban[HBP_IBAN_MAX + 1];
 	uint32_t	user_id;
 	uint32_t	card_id;
@@ -71,6 +197,386 @@ struct connection {
 	char		pin[HBP_PIN_MAX + 1];  /* only used for foreign hosts */
 };
 
+/**
+ * @brief Request in flight on a worker
+ *
+ * Every connection a worker picks up is handled on a fiber of its own. A fiber that has to wait for the database is
+ * parked, so the worker can handle other connections in the meantime.
+ */
+struct fiber {
+	/** Context of this fiber */
+	ucontext_t	ctx;
+	/** Stack of this fiber (#WORKER_STACK_SIZE bytes) */
+	char		*stack;
+	/** Connection being handled, NULL if this fiber is free */
+	struct connection *conn;
+	/** File descriptor this fiber is waiting for, -1 if it isn't waiting for one */
+	int		fd;
+	/** MYSQL_WAIT_* flags this fiber is waiting for */
+	int		status;
+	/** MYSQL_WAIT_* flags that are ready, 0 while the fiber is still waiting */
+	int		ready;
+	/** Time at which the wait times out, if #MYSQL_WAIT_TIMEOUT is set */
+	struct timespec	deadline;
+	/** Next free or parked fiber */
+	struct fiber	*next;
+};
+
+/**
+ * @brief Worker thread information
+ *
+ * Requests are handled by a fixed number of worker threads. Everything a worker needs to handle a request is allocated
+ * once when the worker is started and reused for every request it handles.
+ */
+struct worker {
+	/** Worker thread */
+	pthread_t	thread;
+	/** Index of this worker */
+	unsigned int	id;
+	/** epoll(7) instance watching the database connections parked fibers are waiting for */
+	int		epfd;
+	/** Context of the scheduler, fibers switch back to it when they're parked or done */
+	ucontext_t	ctx;
+	/** Fibers of this worker (#WORKER_FIBERS) */
+	struct fiber	*fibers;
+	/** Fiber that's currently running, NULL if the scheduler is running */
+	struct fiber	*current;
+	/** Free fibers */
+	struct fiber	*free;
+	/** Parked fibers */
+	struct fiber	*parked;
+	/** Number of fibers in flight */
+	unsigned int	active;
+	/** Whether this worker waits for new connections in epoll_wait(2) rather than on the queue */
+	bool		polling;
+	/** Pipe other threads write the fibers they wake up to (see worker_wake()) */
+	int		wakefd[2];
+};
+
+/**
+ * @brief Something a request waits for that's completed by another thread (see worker_sleep() and worker_wake())
+ */
+struct waiter {
+	/** Worker the request is running on, NULL if it isn't running on a worker */
+	struct worker	*worker;
+	/** Fiber the request is running on */
+	struct fiber	*fiber;
+	/** Set by worker_wake() */
+	atomic_bool	woken;
+};
+
+#if SQLITE
+/** @brief Prepared statements, every pooled database connection prepares all of them once */
+typedef enum {
+	/** Look up a card by its IBAN */
+	STMT_CARD,
+	/** Look up a card by an IBAN shorter than #DB_IBAN_KEY_LEN, which has no usable `iban_key` */
+	STMT_CARD_SHORT,
+	/** Reset the login attempts counter of a card */
+	STMT_ATTEMPTS_RESET,
+	/** Increment the login attempts counter of a card */
+	STMT_ATTEMPTS_INC,
+	/** Look up the balance of an account */
+	STMT_BALANCE,
+	/** Subtract an amount from an account if its balance is sufficient */
+	STMT_DEBIT,
+	/** Add an amount to an account */
+	STMT_CREDIT,
+	/** Look up the name of a user */
+	STMT_USER,
+	/** Look up a page of the transactions of an account */
+	STMT_HISTORY,
+	/** Record a transaction in the `transactions` table */
+	STMT_HISTORY_INSERT,
+	/** Start a transaction, taking the write lock right away */
+	STMT_BEGIN,
+	/** Commit the current transaction */
+	STMT_COMMIT,
+	/** Roll back the current transaction */
+	STMT_ROLLBACK,
+	/** Start a single transfer within the current transaction */
+	STMT_SAVEPOINT,
+	/** Keep a single transfer */
+	STMT_RELEASE,
+	/** Undo a single transfer */
+	STMT_ROLLBACK_TO,
+	STMT_COUNT
+} stmt_t;
+#else
+/** @brief Prepared statements, every pooled database connection prepares all of them once */
+typedef enum {
+	/** Look up a card by its IBAN */
+	STMT_CARD,
+	/** Look up a card by an IBAN shorter than #DB_IBAN_KEY_LEN, which has no usable `iban_key` */
+	STMT_CARD_SHORT,
+	/** Reset the login attempts counter of a card */
+	STMT_ATTEMPTS_RESET,
+	/** Increment the login attempts counter of a card */
+	STMT_ATTEMPTS_INC,
+	/** Look up the balance of an account */
+	STMT_BALANCE,
+	/** Transfer an amount between accounts in a single transaction (the `transfer` stored procedure) */
+	STMT_TRANSFER,
+	/** Transfer an amount between accounts as part of a larger transaction (the `transfer_apply` stored procedure) */
+	STMT_TRANSFER_APPLY,
+	/** Look up the name of a user */
+	STMT_USER,
+	/** Look up a page of the transactions of an account */
+	STMT_HISTORY,
+	STMT_COUNT
+} stmt_t;
+#endif
+
+/**
+ * @brief Pooled database connection
+ *
+ * A fixed number of database connections is shared by all workers. A connection is only borrowed for as long as a
+ * single query takes.
+ */
+struct db_conn {
+	/** Pool this connection belongs to (see struct #db_pool) */
+	struct db_pool	*pool;
+#if SQLITE
+	/** SQLite database connection */
+	sqlite3		*sql;
+	/** Prepared statements (see #stmt_t) */
+	sqlite3_stmt	*stmt[STMT_COUNT];
+#else
+	/** MySQL database connection, NULL if it has been lost and reconnecting failed */
+	MYSQL		*sql;
+	/** Prepared statements (see #stmt_t) */
+	MYSQL_STMT	*stmt[STMT_COUNT];
+#endif
+	/** Last time the connection was known to be alive */
+	time_t		checked;
+	/** Time at which the connection was borrowed */
+	struct timespec	acquired;
+	/** Next idle connection */
+	struct db_conn	*next;
+};
+
+/** @brief Request waiting for a connection of a pool that's exhausted */
+struct db_waiter {
+	/** Woken up once a connection has been handed to it */
+	struct waiter	waiter;
+	/** The connection it has been handed */
+	struct db_conn	*db;
+	/** Next request waiting for the same pool */
+	struct db_waiter *next;
+};
+
+/**
+ * @brief Pool of connections to a single database server
+ *
+ * There's a pool for the primary, which handles all writes, and one for every replica reads can be routed to.
+ */
+struct db_pool {
+	/** Host name of the database server (the database file when using SQLite) */
+	const char	*host;
+	/** Port number of the database server */
+	uint16_t	port;
+	/** Whether the database server is a replica */
+	bool		replica;
+	/** Connections of this pool */
+	struct db_conn	*conns;
+	/** Idle connections */
+	struct db_conn	*idle;
+	/** Number of connections, in use and the maximum that has been in use */
+	unsigned int	size, busy, peak;
+	/** Protects the fields below and the list of idle connections */
+	pthread_mutex_t	lock;
+	/** Requests waiting for a connection, oldest first, a connection that's given back is handed to the first one */
+	struct db_waiter *waiting, *waiting_tail;
+	/** Replicas only: reads are not routed to this replica until this time (it's unreachable or lagging) */
+	time_t		avoid_until;
+	/** Replicas only: last time the replication lag has been checked */
+	time_t		lag_checked;
+	/** Statistics (see db_stats()) */
+	struct timespec	stat_start;
+	unsigned long	stat_acquired, stat_waited, stat_reconnects;
+	unsigned long long stat_wait, stat_wait_max, stat_busy;
+};
+
+/** @brief Types of request parameters */
+typedef enum {
+	/** Any value, only the location of its msgpack data is returned (see param.via.raw) */
+	PARAM_RAW,
+	/** nil */
+	PARAM_NIL,
+	/** Unsigned integer, negative values are rejected (see param.via.u64) */
+	PARAM_UINT,
+	/** Signed integer (see param.via.i64) */
+	PARAM_INT,
+	/** String, not null terminated (see param.via.str) */
+	PARAM_STR
+} param_type_t;
+
+/**
+ * @brief Decoded request parameter
+ *
+ * Strings and raw values point into the request data, which is decoded in place without copying it.
+ */
+struct param {
+	/** Type of the parameter, #PARAM_NIL for a nil #PARAM_RAW parameter */
+	param_type_t	type;
+	union {
+		uint64_t	u64;
+		int64_t		i64;
+		struct {
+			const char	*ptr;
+			uint32_t	size;
+		} str, raw;
+	} via;
+};
+
+/** @brief Maximum number of parameters of a request */
+#define HANDLER_PARAMS_MAX	3
+
+/** @brief Sessions in which a request is allowed */
+typedef enum {
+	/** Allowed without a session */
+	HANDLER_ANONYMOUS	= 1 << 0,
+	/** Allowed in a session of a local account */
+	HANDLER_LOCAL		= 1 << 1,
+	/** Allowed in a session of a NOOB account */
+	HANDLER_NOOB		= 1 << 2
+} handler_flags_t;
+
+/** @brief How expensive it is to handle a request */
+typedef enum {
+	/** Handled in memory */
+	COST_LOW,
+	/** Requires one or more database queries */
+	COST_DATABASE,
+	/** Requires password hashing or a request to NOOB */
+	COST_HIGH
+} handler_cost_t;
+
+/**
+ * @brief Request handler descriptor
+ *
+ * Every type of request is described by a descriptor in a table indexed by the request type. The request is checked
+ * against the descriptor before its handler is called.
+ */
+struct handler {
+	/** Name of the request, used for logging */
+	const char	*name;
+	/**
+	 * Function handling the request, which packs the reply parameters and sets the reply type
+	 * (params holds the decoded parameters, or the raw request data if there's no schema)
+	 */
+	bool		(*handle)(struct connection *conn, const struct param *params, struct hbp_header *reply,
+				msgpack_packer *pack);
+	/** Sessions in which this request is allowed (see #handler_flags_t) */
+	unsigned int	flags;
+	/** Expected type of every parameter, NULL if the handler decodes the request data itself */
+	const param_type_t *schema;
+	/** Number of parameters in schema (max. #HANDLER_PARAMS_MAX) */
+	unsigned int	nparams;
+	/** How expensive it is to handle this request (see #handler_cost_t) */
+	handler_cost_t	cost;
+
+	/** Number of requests handled */
+	atomic_ulong	count;
+	/** Number of requests that failed */
+	atomic_ulong	errors;
+	/** Total time spent handling requests in nanoseconds */
+	atomic_ullong	time;
+};
+
+/** @brief Maximum length of the first or last name of a user in bytes */
+#define DB_NAME_MAX	128
+/** @brief Maximum length of an encoded PIN hash in bytes */
+#define DB_PIN_MAX	128
+/** @brief Length of the IBAN prefix cards are looked up by (`cards`.`iban_key`) */
+#define DB_IBAN_KEY_LEN	16
+
+/** @brief Card information (see db_card()) */
+struct db_card {
+	/** User ID of the card holder */
+	uint32_t	user_id;
+	/** Card ID */
+	uint32_t	card_id;
+	/** Number of failed login attempts */
+	unsigned int	attempts;
+	/** Encoded argon2 hash of the PIN */
+	char		pin[DB_PIN_MAX + 1];
+	/** Full IBAN of the card */
+	char		iban[HBP_IBAN_MAX + 1];
+};
+
+/** @brief Transfer that's committed together with others (see db_transfers()) */
+struct db_transfer {
+	/** IBAN of the source account */
+	const char	*source;
+	/** IBAN of the destination account, empty for a withdrawal */
+	const char	*dest;
+	/** Amount in Eurocents */
+	int64_t		amount;
+	/** Result, see db_transfer() */
+	int		result;
+};
+
+/** @brief Transaction read back from the `transactions` table (see db_transactions()) */
+struct db_transaction {
+	/** Transaction ID */
+	uint64_t	id;
+	/** Time of the transaction (UNIX timestamp) */
+	int64_t		time;
+	/** Amount in Eurocents */
+	int64_t		amount;
+	/** Result of the transfer (see #hbp_rep_transfer_result_t) */
+	uint8_t		status;
+	/** IBAN of the source account */
+	char		source[HBP_IBAN_MAX + 1];
+	/** IBAN of the destination account, empty for a withdrawal */
+	char		dest[HBP_IBAN_MAX + 1];
+};
+
+/**
+ * @brief Transaction to be recorded in the `transactions` table (see history_record())
+ *
+ * Also the format of the records in the spill file.
+ */
+struct history_record {
+	/** Time of the transaction (UNIX timestamp) */
+	int64_t		time;
+	/** Amount in Eurocents */
+	int64_t		amount;
+	/** Result of the transfer (see #hbp_rep_transfer_result_t) */
+	uint8_t		status;
+	/** IBAN of the source account */
+	char		source[HBP_IBAN_MAX + 1];
+	/** IBAN of the destination account, empty for a withdrawal */
+	char		dest[HBP_IBAN_MAX + 1];
+};
+
+/** @brief Request waiting for room in the history queue (see history_record()) */
+struct history_waiter {
+	/** Woken up once the writer has taken transactions off the queue */
+	struct waiter	waiter;
+	/** Next request waiting for room */
+	struct history_waiter *next;
+};
+
+/** @brief Transfer waiting for the next group commit */
+struct commit {
+	/** The transfer itself */
+	struct db_transfer transfer;
+	/** Woken up once the transfer has been committed */
+	struct waiter	waiter;
+	/** Next transfer waiting for the same commit */
+	struct commit	*next;
+};
+
+/** @brief Position in the request data that is being decoded */
+struct unpacker {
+	/** Next byte to decode */
+	const unsigned char	*ptr;
+	/** End of the request data */
+	const unsigned char	*end;
+};
+
 /** @brief argon2: Number of passes to make */
 #define ARGON2_PASS	2
 /** @brief argon2: Memory usage limit */
@@ -91,63 +597,611 @@ extern SSL_CTX *ctx;
 #endif
 extern char *sql_host, *sql_db, *sql_user, *sql_pass;
 extern uint16_t sql_port;
+extern unsigned int worker_count, queue_max, acceptors, db_count;
+#if IOURING
+extern unsigned int connections_max;
+#endif
+extern unsigned int commit_window, commit_batch;
+extern char *replica_hosts[DB_REPLICAS_MAX];
+extern uint16_t replica_ports[DB_REPLICAS_MAX];
+extern unsigned int replica_count;
+
+/** @brief Log levels, messages are logged if their level is at or below the current log level */
+typedef enum {
+	/** Informational messages, always logged */
+	LOG_INFO,
+	/** Debugging messages, only logged in verbose mode (when running with -v) */
+	LOG_DEBUG
+} log_level_t;
+
+/** @brief Highest log level that is compiled in, debugging messages are left out of builds without DEBUG */
+#if DEBUG
+#  define LOG_LEVEL_MAX	LOG_DEBUG
+#else
+#  define LOG_LEVEL_MAX	LOG_INFO
+#endif
+
+/** @brief Current log level (see #log_level_t), only set while starting up */
+extern log_level_t log_level;
+
+/**
+ * @brief Start the log writer thread
+ *
+ * @param path Path of the file to write the log to, NULL to only log to the command-line
+ * @param level Log level (see #log_level_t)
+ *
+ * @return false if an error occured
+ */
+bool log_start(const char *path, log_level_t level);
+
+/**
+ * @brief Write out all log messages that are still waiting and stop the log writer thread
+ */
+void log_stop(void);
 
 /**
  * @brief Log to command-line (and optionally to a log file)
  *
- * This function prints to the command-line when debug is false (or always when the -v flag is specified in argv).
- * The log is also written to a file (when -o is specified in argv).
- * Parameters after debug are exactly the same as printf(3).
+ * The log is written to a file when -o is specified in argv. Use #lprintf instead of calling this directly, so the
+ * message is only formatted if its level is enabled.
+ * Parameters are exactly the same as printf(3).
+ *
+ * Messages are formatted by the calling thread and queued in a buffer of that thread, a separate thread writes them
+ * out. Messages are dropped (and counted) if the buffer of a thread is full.
  *
- * @param debug Specifies if this is a debugging message or info message
  * @param fmt Specifies how subsequent arguments are converted
  * @param ... Variable number of arguments
  */
-void lprintf(bool debug, const char *fmt, ...);
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Check if messages of the specified level are logged
+ *
+ * This costs a single branch, which the compiler removes entirely for levels that haven't been compiled in. Use this
+ * to skip preparing something that's only needed for logging.
+ */
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && __builtin_expect((level) <= log_level, (level) == LOG_INFO))
+
+/** @brief Log a message of the specified level, the arguments are only evaluated if the level is enabled */
+#define lprintf(level, fmt, args...) do { \
+	if (log_enabled(level)) \
+		log_write(fmt, ## args); \
+} while (0)
 
 /** @brief wrapper around lprintf, print even in non-verbose mode */
-#define iprintf(fmt, args...) lprintf(false, fmt, ## args)
+#define iprintf(fmt, args...) lprintf(LOG_INFO, fmt, ## args)
 
 /** @brief wrapper around lprintf, print only in verbose mode (when running with -v) */
-#define dprintf(fmt, args...) lprintf(true, fmt, ## args)
+#define dprintf(fmt, args...) lprintf(LOG_DEBUG, fmt, ## args)
 
 /**
- * @brief Session thread
+ * @brief Setup a new client connection
+ *
+ * Retrieves the client's address and prepares the TLS/SSL connection. The socket must be non-blocking.
  *
- * This function is called on a new thread for every client that connects to our server.
+ * @param conn Connection structure (see struct #connection) with the socket and database connection filled in
  *
- * @param args An argument list received from the main thread, in our case containing only a copy of the client socket
- *             connection handler
+ * @return true on success, false if the connection should be closed
  */
-void *session(void *args);
+bool session_open(struct connection *conn);
 
 /**
- * @brief Escape a string to be used in a MySQL query
+ * @brief Continue the TLS/SSL handshake and verify the client certificate
  *
  * @param conn Connection structure (see struct #connection)
- * @param str String to escape
- * @param limit Maximum length of the output string (excluding null terminator), set to 0 for no limit
  *
- * @return A pointer to a heap allocated (malloc) escaped string. NULL if out of memory or if the limit was exceeded
+ * @return 1 if the handshake has completed, 0 if more data is needed from the client and -1 if the connection should
+ *         be closed
  */
-char *escape(struct connection *conn, const char *str, size_t limit);
+int session_handshake(struct connection *conn);
 
 /**
- * @brief Run a MySQL query
+ * @brief Retrieve where received data should be stored in the input buffer
+ *
+ * Used by event loops that receive data on behalf of the session, see #session_received.
  *
  * @param conn Connection structure (see struct #connection)
- * @param fmt Specifies how subsequent arguments are converted
- * @param ... Variable number of arguments
+ * @param buf Set to where the received bytes should be stored
  *
- * @return A pointer to the MYSQL_RES result structure. NULL if an error occured.
+ * @return The maximum number of bytes that can be stored in buf, 0 if the input buffer is full
  */
-MYSQL_RES *query(struct connection *conn, const char *fmt, ...);
+size_t session_want(struct connection *conn, char **buf);
+
+/**
+ * @brief Account for bytes that have been received in the buffer returned by #session_want
+ *
+ * Takes the next complete request out of the input buffer, if there is one. This may also be called with n = 0 to
+ * check for requests that have already been received.
+ *
+ * @param conn Connection structure (see struct #connection)
+ * @param n Number of bytes received
+ *
+ * @return 1 if a complete request is available, 0 if more data is needed from the client and -1 if the connection
+ *         should be closed
+ */
+int session_received(struct connection *conn, size_t n);
+
+/**
+ * @brief Remove bytes that have been sent to the client from the output buffer
+ *
+ * @param conn Connection structure (see struct #connection)
+ * @param n Number of bytes sent
+ */
+void session_sent(struct connection *conn, size_t n);
+
+/**
+ * @brief Check if there's room in the output buffer for another reply
+ *
+ * @param conn Connection structure (see struct #connection)
+ *
+ * @return true if another request can be handled
+ */
+bool session_writable(struct connection *conn);
+
+/**
+ * @brief Receive a request from the client without blocking
+ *
+ * @param conn Connection structure (see struct #connection)
+ *
+ * @return 1 if a complete request has been received, 0 if more data is needed from the client and -1 if the
+ *         connection should be closed
+ */
+int session_recv(struct connection *conn);
+
+/**
+ * @brief Handle the received request and any further requests that are available without blocking
+ *
+ * @param conn Connection structure (see struct #connection) containing a complete request
+ * @param worker The worker thread handling the request (see struct #worker)
+ *
+ * @return 0 if no more requests are available right now and -1 if the connection should be closed
+ */
+int session_process(struct connection *conn, struct worker *worker);
+
+/**
+ * @brief Reply to the received request with #HBP_REP_ERROR because it can't be handled right now
+ *
+ * @param conn Connection structure (see struct #connection) containing a complete request
+ *
+ * @return false if the connection should be closed
+ */
+bool session_reject(struct connection *conn);
+
+/**
+ * @brief Send the queued replies without blocking
+ *
+ * @param conn Connection structure (see struct #connection)
+ *
+ * @return 1 if everything has been sent, 0 if data is still pending and -1 if the connection should be closed
+ */
+int session_flush(struct connection *conn);
+
+/**
+ * @brief Log the number of requests handled and failed, and the average time spent on them, per type of request
+ */
+void session_stats(void);
+
+/**
+ * @brief Close a client connection and release the resources associated with it
+ *
+ * @param conn Connection structure (see struct #connection)
+ */
+void session_close(struct connection *conn);
+
+/**
+ * @brief Run the event loops
+ *
+ * Every event loop accepts new clients on its own listening socket and drives its client connections using
+ * edge-triggered epoll(7). Complete requests are handed off to the worker threads. Statistics are logged when receiving
+ * SIGUSR1, which must be blocked by the caller.
+ * The first event loop runs on the calling thread, every other event loop gets its own thread. If there's more than
+ * one event loop, every event loop is pinned to its own CPU.
+ * This function only returns if an unrecoverable error has occured.
+ *
+ * @param socks Non-blocking listening sockets, one for every event loop
+ * @param count Number of event loops to run
+ *
+ * @return false if an error occured
+ */
+bool reactor_run(const int *socks, unsigned int count);
+
+/**
+ * @brief Have the event loop watch a connection again after a worker is done with it
+ *
+ * @param conn Connection structure (see struct #connection)
+ */
+void reactor_rearm(struct connection *conn);
+
+/**
+ * @brief Close a connection and remove it from the event loop
+ *
+ * @param conn Connection structure (see struct #connection)
+ */
+void reactor_drop(struct connection *conn);
+
+/**
+ * @brief Start the worker threads
+ *
+ * @param count Number of worker threads to start
+ * @param queue_max Maximum number of connections that can be waiting for a worker
+ *
+ * @return false if an error occured
+ */
+bool worker_start(unsigned int count, unsigned int queue_max);
+
+/**
+ * @brief Hand a connection with a complete request off to the worker threads
+ *
+ * The connection is owned by the worker threads until they rearm or drop it.
+ *
+ * @param conn Connection structure (see struct #connection) containing a complete request
+ *
+ * @return false if the queue is full and the request has been rejected
+ */
+bool worker_submit(struct connection *conn);
+
+/**
+ * @brief Park the current request until a database connection is ready
+ *
+ * The worker handles other requests in the meantime. When not called from a request handled by a worker, this blocks
+ * the calling thread instead.
+ *
+ * @param fd Socket of the database connection
+ * @param status MYSQL_WAIT_* flags returned by one of the non-blocking MariaDB functions
+ * @param timeout Timeout in milliseconds (see mysql_get_timeout_value_ms()), only used if #MYSQL_WAIT_TIMEOUT is set in status
+ *
+ * @return MYSQL_WAIT_* flags that are ready, to be passed to the corresponding _cont() function
+ */
+int worker_wait(int fd, int status, unsigned int timeout);
+
+/**
+ * @brief Prepare to wait for another thread
+ *
+ * Must be called before the waiter is handed to the other thread.
+ *
+ * @param waiter Waiter to initialize (see struct #waiter)
+ */
+void worker_prepare(struct waiter *waiter);
+
+/**
+ * @brief Park the current request until another thread calls worker_wake() on the waiter
+ *
+ * The worker handles other requests in the meantime. When not called from a request handled by a worker, this blocks
+ * the calling thread instead.
+ *
+ * @param waiter Waiter initialized by worker_prepare() (see struct #waiter)
+ */
+void worker_sleep(struct waiter *waiter);
+
+/**
+ * @brief Resume a request waiting in worker_sleep()
+ *
+ * The waiter may no longer exist as soon as this has been called.
+ *
+ * @param waiter Waiter initialized by worker_prepare() (see struct #waiter)
+ */
+void worker_wake(struct waiter *waiter);
+
+/**
+ * @brief Run a blocking call on a separate thread and park the current request until it has returned
+ *
+ * The worker handles other requests in the meantime. When not called from a request handled by a worker, the call is
+ * made on the calling thread instead.
+ *
+ * @param fn Function to call
+ * @param arg Argument passed to fn, must stay valid until this returns
+ */
+void worker_run(void (*fn)(void *), void *arg);
+
+/** @brief Log statistics about the worker threads and the queue */
+void worker_stats(void);
+
+/**
+ * @brief Open the journal and start syncing it to disk periodically
+ *
+ * Events are appended after the last complete record if the journal already exists. Once it's full, the journal is
+ * renamed to its path followed by the current time (e.g. hb.journal.1700000000) and a new one is started.
+ *
+ * @param path Path of the journal file
+ *
+ * @return false if an error occured
+ */
+bool journal_open(const char *path);
+
+/**
+ * @brief Append an event to the journal
+ *
+ * This can be called from any thread and takes no locks, it only blocks while a full journal is being replaced by a
+ * new one. Nothing is recorded if the journal hasn't been opened.
+ *
+ * @param conn Connection structure of the session (see struct #connection)
+ * @param event Type of event (see #journal_event_t)
+ * @param opcode Type of the request that caused the event (see #hbp_request_t)
+ * @param iban IBAN of the session
+ * @param dest Destination IBAN of a transfer, NULL if none
+ * @param amount Amount transferred in Eurocents
+ * @param result Result of the event (see journal_record.result)
+ */
+void journal_write(const struct connection *conn, journal_event_t event, uint8_t opcode, const char *iban,
+		const char *dest, int64_t amount, int result);
+
+/**
+ * @brief Sync the journal to disk and close it
+ */
+void journal_close(void);
+
+/**
+ * @brief Start committing transfers in groups
+ *
+ * Transfers are collected for up to window microseconds after the first one arrives, or until there are batch transfers,
+ * and committed in a single transaction.
+ *
+ * @param window Time in microseconds to wait for more transfers, 0 commits every transfer on its own
+ * @param batch Maximum number of transfers per commit
+ *
+ * @return false if an error occured
+ */
+bool commit_start(unsigned int window, unsigned int batch);
+
+/**
+ * @brief Commit the transfers that are still waiting and stop committing transfers in groups
+ */
+void commit_stop(void);
+
+/**
+ * @brief Transfer an amount from one account to another as part of the next group commit
+ *
+ * The request is parked until the transfer has been committed.
+ *
+ * @param source IBAN of the source account
+ * @param dest IBAN of the destination account, empty for a withdrawal
+ * @param amount Amount in Eurocents
+ *
+ * @return See db_transfer()
+ */
+int commit_transfer(const char *source, const char *dest, int64_t amount);
+
+/** @brief Log statistics about the group commits */
+void commit_stats(void);
+
+/**
+ * @brief Start writing recorded transactions to the database in the background
+ *
+ * Transactions that were left in the spill file by a previous run are written first.
+ *
+ * @param path Path of the spill file, transactions are kept there while the database is unavailable
+ *
+ * @return false if an error occured
+ */
+bool history_start(const char *path);
+
+/**
+ * @brief Write the transactions that are still waiting (or spill them) and stop writing transactions
+ */
+void history_stop(void);
+
+/**
+ * @brief Record a transaction in the `transactions` table
+ *
+ * Only for transactions that aren't recorded by the database itself, such as withdrawals with cards of other banks.
+ * This doesn't wait for the database, transactions are written in batches by a background thread. It only waits for
+ * the writer if the queue is full (#HISTORY_QUEUE_SIZE).
+ *
+ * @param source IBAN of the source account
+ * @param dest IBAN of the destination account, empty for a withdrawal
+ * @param amount Amount in Eurocents
+ * @param status Result of the transfer (see #hbp_rep_transfer_result_t)
+ */
+void history_record(const char *source, const char *dest, int64_t amount, uint8_t status);
+
+/** @brief Log statistics about the transactions that have been recorded */
+void history_stats(void);
+
+/**
+ * @brief Start decoding msgpack request data
+ *
+ * @param u Decoder state (see struct #unpacker)
+ * @param data Request data, must stay valid as long as the decoded parameters are used
+ * @param len Length of the request data in bytes
+ */
+void unpack_init(struct unpacker *u, const char *data, uint16_t len);
+
+/**
+ * @brief Decode the header of an array
+ *
+ * @param u Decoder state (see struct #unpacker)
+ * @param n Receives the number of elements, which are decoded next
+ *
+ * @return True if the next object is an array. False if it isn't or if the data is truncated
+ */
+bool unpack_array(struct unpacker *u, uint32_t *n);
+
+/**
+ * @brief Decode a single parameter
+ *
+ * @param u Decoder state (see struct #unpacker)
+ * @param type Expected type of the parameter (see #param_type_t)
+ * @param param Receives the decoded parameter (see struct #param)
+ *
+ * @return True if the next object has the expected type. False if it doesn't or if the data is invalid or truncated
+ */
+bool unpack_param(struct unpacker *u, param_type_t type, struct param *param);
+
+/**
+ * @brief Decode and validate the parameters of a request
+ *
+ * @param data Request data
+ * @param len Length of the request data in bytes
+ * @param schema Expected type of every parameter (see #param_type_t)
+ * @param params Receives the decoded parameters (see struct #param)
+ * @param count Number of parameters
+ *
+ * @return True if the request data is an array of exactly count parameters with the types from schema
+ */
+bool unpack_params(const char *data, uint16_t len, const param_type_t *schema, struct param *params, uint32_t count);
+
+/**
+ * @brief Connect all database connections in the pools of the primary and the replicas
+ *
+ * Replicas that can't be reached are skipped for now, reads go to the primary instead.
+ *
+ * When built with SQLite, the connections open the database file instead (the database name, see -d) and there are
+ * no replicas. SQLite calls block the worker until they're done rather than parking the request.
+ *
+ * @param size Number of database connections per database server
+ *
+ * @return false if an error occured
+ */
+bool db_start(unsigned int size);
+
+/**
+ * @brief Close all database connections in the pools
+ */
+void db_stop(void);
+
+/**
+ * @brief Borrow a database connection from a pool, waiting for one to become available if needed
+ *
+ * Connections that haven't been used for #DB_PING_INTERVAL seconds are checked first and reconnected if needed.
+ * Reads that can go to a replica are spread over the replicas that are reachable and not lagging more than
+ * #DB_LAG_MAX seconds behind, the primary is used if there are none.
+ *
+ * @param replica Whether a connection to a replica may be returned, only for reads
+ *
+ * @return A database connection (see struct #db_conn), NULL if the connection was lost and reconnecting failed
+ */
+struct db_conn *db_acquire(bool replica);
+
+/**
+ * @brief Return a borrowed database connection to the pool
+ *
+ * @param db Database connection (see struct #db_conn)
+ */
+void db_release(struct db_conn *db);
+
+/**
+ * @brief Log the utilization of the database connection pools and the time spent waiting for a connection
+ */
+void db_stats(void);
+
+/**
+ * @brief Look up a card by its IBAN
+ *
+ * IBANs without the last 2 characters are accepted too, some other groups omit these.
+ *
+ * @param iban IBAN of the card
+ * @param card Receives the card information (see struct #db_card)
+ *
+ * @return 1 if the card has been found, 0 if it hasn't and -1 on error
+ */
+int db_card(const char *iban, struct db_card *card);
+
+/**
+ * @brief Update the number of failed login attempts of a card
+ *
+ * @param iban Full IBAN of the card
+ * @param reset Reset the counter after a successful login instead of incrementing it
+ *
+ * @return false if an error occured
+ */
+bool db_attempts(const char *iban, bool reset);
+
+/**
+ * @brief Look up the balance of an account
+ *
+ * @param iban IBAN of the account
+ * @param balance Receives the balance in Eurocents
+ * @param replica Whether the balance may be read from a replica (see db_acquire())
+ *
+ * @return 1 if the account has been found, 0 if it hasn't and -1 on error
+ */
+int db_balance(const char *iban, int64_t *balance, bool replica);
+
+/**
+ * @brief Transfer an amount from one account to another and record it, in a single transaction
+ *
+ * The amount is only subtracted if the balance of the source account is sufficient.
+ *
+ * @param source IBAN of the source account
+ * @param dest IBAN of the destination account, empty for a withdrawal
+ * @param amount Amount in Eurocents
+ *
+ * @return 1 if the amount has been transferred, 0 if the balance is insufficient (or the source account doesn't exist)
+ *         and -1 on error (nothing has been transferred)
+ */
+int db_transfer(const char *source, const char *dest, int64_t amount);
+
+/**
+ * @brief Run a number of transfers in a single transaction
+ *
+ * Transfers that fail are rolled back individually, the others are still committed. The result of every transfer is
+ * stored in the transfer itself.
+ *
+ * @param transfers Transfers (see struct #db_transfer)
+ * @param count Number of transfers
+ *
+ * @return false if the transaction as a whole failed, none of the transfers have been committed
+ */
+bool db_transfers(struct db_transfer **transfers, unsigned int count);
+
+/**
+ * @brief Record transactions in the `transactions` table using a single INSERT
+ *
+ * @param records Transactions (see struct #history_record)
+ * @param count Number of transactions
+ *
+ * @return false if an error occured, none of the transactions have been recorded
+ */
+bool db_history(const struct history_record *records, unsigned int count);
+
+/**
+ * @brief Look up the name of a user
+ *
+ * @param user_id User ID
+ * @param first_name Receives the first name (min. #DB_NAME_MAX + 1 bytes)
+ * @param last_name Receives the last name (min. #DB_NAME_MAX + 1 bytes)
+ * @param replica Whether the name may be read from a replica (see db_acquire())
+ *
+ * @return 1 if the user has been found, 0 if it hasn't and -1 on error
+ */
+int db_user(uint32_t user_id, char *first_name, char *last_name, bool replica);
+
+/**
+ * @brief Look up the most recent transactions of an account, older than a given transaction
+ *
+ * Pages are found through the (`source_iban`, `transaction_id`) and (`dest_iban`, `transaction_id`) indexes, so this
+ * only reads about as many rows as it returns, regardless of the number of transactions of the account.
+ *
+ * @param iban IBAN of the account
+ * @param cursor Only transactions with a lower ID are returned, 0 for the most recent transactions
+ * @param transactions Receives the transactions, most recent first (see struct #db_transaction)
+ * @param max Maximum number of transactions
+ * @param replica Whether the transactions may be read from a replica (see db_acquire())
+ *
+ * @return The number of transactions or -1 on error
+ */
+int db_transactions(const char *iban, uint64_t cursor, struct db_transaction *transactions, unsigned int max,
+		bool replica);
+
+/**
+ * @brief End the session of a connection, clearing everything that was kept about it
+ *
+ * @param conn Connection structure (see struct #connection)
+ */
+void login_clear(struct connection *conn);
 
 /* HBP (local) request handlers */
-bool login(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack);
-bool info(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack);
-bool balance(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack);
-bool transfer(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack);
+bool login(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack);
+bool logout(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack);
+bool info(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack);
+bool balance(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack);
+bool transfer(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack);
+bool statement(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack);
+
+/* request parameters */
+extern const param_type_t login_schema[HBP_REQ_LOGIN_LENGTH];
+extern const param_type_t transfer_schema[HBP_REQ_TRANSFER_LENGTH];
+extern const param_type_t statement_schema[HBP_REQ_HISTORY_LENGTH];
 
 /* NOOB (international) request handlers */
 #define BUF_SIZE 256
@@ -0,0 +1,347 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+static pthread_t writer;
+/* running is cleared to stop the writer, stopped is set by the writer once the queue has been written */
+static bool running, stopped;
+
+/* transactions waiting to be written to the database */
+static struct history_record queue[HISTORY_QUEUE_SIZE];
+static unsigned int head, pending;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t history_cond;
+
+/* requests waiting for room in the queue, oldest first */
+static struct history_waiter *waiting, *waiting_tail;
+
+/*
+ * transactions that couldn't be written to the database are appended to the spill file, which is replayed once the
+ * database is available again
+ * A crash while replaying may cause the replayed transactions to be written twice, but never causes any to be lost.
+ */
+static int spill_fd = -1;
+static off_t spill_replayed;
+/* the spill file has transactions that haven't been replayed yet, it may have been left behind by a previous run */
+static bool spill_pending = true;
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* statistics */
+static unsigned long stat_recorded, stat_written, stat_spilled, stat_replayed, stat_inserts, stat_waited, stat_lost;
+
+/* append transactions to the spill file and make sure they're on disk */
+static bool spill(const struct history_record *records, unsigned int count)
+{
+	size_t len = count * sizeof(struct history_record);
+	off_t end;
+	bool res;
+
+	pthread_mutex_lock(&spill_lock);
+	end = lseek(spill_fd, 0, SEEK_END);
+	if (!(res = write(spill_fd, records, len) == (ssize_t) len && !fdatasync(spill_fd))) {
+		iprintf("unable to write %u transactions to the spill file: %s\n", count, strerror(errno));
+
+		/* don't leave part of a record behind, it would misalign the ones that are spilled after it */
+		if (end >= 0 && ftruncate(spill_fd, end) < 0)
+			iprintf("unable to truncate the spill file: %s\n", strerror(errno));
+	} else {
+		stat_spilled += count;
+		spill_pending = true;
+	}
+	pthread_mutex_unlock(&spill_lock);
+
+	return res;
+}
+
+/* write the transactions in the spill file to the database, returns false if it's still unavailable */
+static bool replay(void)
+{
+	struct history_record records[HISTORY_BATCH];
+	struct stat st;
+	ssize_t len;
+	unsigned int n;
+
+	for (;;) {
+		pthread_mutex_lock(&spill_lock);
+		if (!spill_pending) {
+			pthread_mutex_unlock(&spill_lock);
+			return true;
+		}
+
+		if (fstat(spill_fd, &st) < 0) {
+			iprintf("unable to check the spill file: %s\n", strerror(errno));
+			pthread_mutex_unlock(&spill_lock);
+
+			return false;
+		}
+
+		if (st.st_size <= spill_replayed) {
+			/* everything has been replayed, start over with an empty file */
+			if (!spill_replayed || ftruncate(spill_fd, 0) == 0) {
+				spill_replayed = 0;
+				spill_pending = false;
+			}
+			pthread_mutex_unlock(&spill_lock);
+
+			return true;
+		}
+
+		len = pread(spill_fd, records, sizeof(records), spill_replayed);
+		pthread_mutex_unlock(&spill_lock);
+
+		/* records are only ever spilled whole */
+		if (len < (ssize_t) sizeof(struct history_record))
+			return false;
+		n = len / sizeof(struct history_record);
+
+		if (!db_history(records, n))
+			return false;
+
+		pthread_mutex_lock(&spill_lock);
+		spill_replayed += n * sizeof(struct history_record);
+		stat_replayed += n;
+		pthread_mutex_unlock(&spill_lock);
+	}
+}
+
+/* take the requests waiting for room in the queue off the list, they're woken up once history_lock is released */
+static struct history_waiter *history_waiters(void)
+{
+	struct history_waiter *waiter = waiting;
+
+	waiting = waiting_tail = NULL;
+
+	return waiter;
+}
+
+static void *history_thread(void *arg)
+{
+	struct history_record records[HISTORY_BATCH];
+	struct history_waiter *waiter, *next;
+	struct timespec deadline;
+	sigset_t mask;
+	unsigned int n = 0;
+
+	/* signals are handled by the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += HISTORY_INTERVAL / 1000;
+		if ((deadline.tv_nsec += (HISTORY_INTERVAL % 1000) * 1000000) >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		/*
+		 * collect transactions for a while, unless there are enough for a full batch already
+		 * A batch that's tried again always waits for the whole interval.
+		 */
+		pthread_mutex_lock(&history_lock);
+		while ((n || pending < HISTORY_BATCH) && running &&
+				pthread_cond_timedwait(&history_cond, &history_lock, &deadline) != ETIMEDOUT)
+			;
+
+		if (!pending && !n && !running) {
+			/* transactions recorded from now on are spilled by history_record() itself */
+			stopped = true;
+			waiter = history_waiters();
+			pthread_mutex_unlock(&history_lock);
+
+			for (; waiter; waiter = next) {
+				next = waiter->next;
+				worker_wake(&waiter->waiter);
+			}
+			break;
+		}
+
+		/* a batch that could neither be written nor spilled is tried again before any newer transactions */
+		if (!n) {
+			for (; pending && n < HISTORY_BATCH; n++, pending--) {
+				records[n] = queue[head];
+				head = (head + 1) % HISTORY_QUEUE_SIZE;
+			}
+		}
+		waiter = history_waiters();
+		pthread_mutex_unlock(&history_lock);
+
+		/* the waiter may be gone once it's woken up */
+		for (; waiter; waiter = next) {
+			next = waiter->next;
+			worker_wake(&waiter->waiter);
+		}
+
+		/* older transactions go first, newer ones are spilled as well until the database is available again */
+		if (replay() && n && db_history(records, n)) {
+			pthread_mutex_lock(&history_lock);
+			stat_written += n;
+			stat_inserts++;
+			pthread_mutex_unlock(&history_lock);
+			n = 0;
+		} else if (n && spill(records, n)) {
+			n = 0;
+		} else if (n && !running) {
+			iprintf("unable to write %u transactions before stopping, they are lost\n", n);
+			pthread_mutex_lock(&history_lock);
+			stat_lost += n;
+			pthread_mutex_unlock(&history_lock);
+			n = 0;
+		}
+	}
+
+	return NULL;
+}
+
+bool history_start(const char *path)
+{
+	pthread_condattr_t attr;
+	struct stat st;
+
+	if ((spill_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+		iprintf("unable to open spill file: %s\n", path);
+		return false;
+	}
+
+	/* a crash may have left part of a record behind, which would misalign the transactions spilled after it */
+	if (fstat(spill_fd, &st) == 0 && st.st_size % sizeof(struct history_record)) {
+		iprintf("dropping an incomplete transaction at the end of the spill file\n");
+		if (ftruncate(spill_fd, st.st_size - st.st_size % sizeof(struct history_record)) < 0)
+			iprintf("unable to truncate the spill file: %s\n", strerror(errno));
+	}
+
+	/* the interval is measured on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&history_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	running = true;
+	if (pthread_create(&writer, NULL, history_thread, NULL)) {
+		iprintf("unable to allocate thread\n");
+		running = false;
+		close(spill_fd);
+		spill_fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void history_stop(void)
+{
+	if (spill_fd < 0)
+		return;
+
+	pthread_mutex_lock(&history_lock);
+	running = false;
+	pthread_cond_signal(&history_cond);
+	pthread_mutex_unlock(&history_lock);
+
+	pthread_join(writer, NULL);
+
+	close(spill_fd);
+	spill_fd = -1;
+}
+
+void history_record(const char *source, const char *dest, int64_t amount, uint8_t status)
+{
+	struct history_record record = {
+		.time	= time(NULL),
+		.amount	= amount,
+		.status	= status
+	};
+	struct history_waiter waiter;
+
+	if (spill_fd < 0)
+		return;
+
+	strncpy(record.source, source, HBP_IBAN_MAX);
+	strncpy(record.dest, dest, HBP_IBAN_MAX);
+
+	pthread_mutex_lock(&history_lock);
+	while (!stopped && pending == HISTORY_QUEUE_SIZE) {
+		/* the writer can't keep up, wait for it rather than spilling here so the transactions stay in order */
+		worker_prepare(&waiter.waiter);
+		waiter.next = NULL;
+		if (waiting_tail)
+			waiting_tail->next = &waiter;
+		else
+			waiting = &waiter;
+		waiting_tail = &waiter;
+		stat_waited++;
+		pthread_mutex_unlock(&history_lock);
+
+		worker_sleep(&waiter.waiter);
+
+		pthread_mutex_lock(&history_lock);
+	}
+
+	if (stopped) {
+		/* the writer is gone, don't lose the transaction */
+		pthread_mutex_unlock(&history_lock);
+		if (!spill(&record, 1)) {
+			pthread_mutex_lock(&history_lock);
+			stat_lost++;
+			pthread_mutex_unlock(&history_lock);
+		}
+		return;
+	}
+
+	queue[(head + pending) % HISTORY_QUEUE_SIZE] = record;
+	stat_recorded++;
+
+	/* the writer only has to look again when a batch is full */
+	if (++pending == HISTORY_BATCH)
+		pthread_cond_signal(&history_cond);
+	pthread_mutex_unlock(&history_lock);
+}
+
+void history_stats(void)
+{
+	if (spill_fd < 0)
+		return;
+
+	pthread_mutex_lock(&history_lock);
+	pthread_mutex_lock(&spill_lock);
+	iprintf("History: %lu transactions recorded, %lu written in %lu inserts, waiting: %u (queue was full %lu times), "
+			"spilled: %lu, replayed: %lu, lost: %lu\n", stat_recorded, stat_written, stat_inserts, pending,
+			stat_waited, stat_spilled, stat_replayed, stat_lost);
+	pthread_mutex_unlock(&spill_lock);
+	pthread_mutex_unlock(&history_lock);
+}
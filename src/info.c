@@ -29,16 +29,14 @@
 #include "hbp.h"
 #include "herbank.h"
 
-bool info(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack)
+bool info(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack)
 {
-	MYSQL_RES *sqlres = NULL;
-	MYSQL_ROW row;
+	char first_name[DB_NAME_MAX + 1], last_name[DB_NAME_MAX + 1];
 
 	/* retrieve the user's first and last name from the database */
-	sqlres = query(conn, "SELECT `first_name`, `last_name` FROM `users` WHERE `user_id` = '%u'", conn->user_id);
-	if (!(row = mysql_fetch_row(sqlres))) {
-		dprintf("invalid user ID: %s\n", conn->user_id);
-		goto err;
+	if (db_user(conn->user_id, first_name, last_name, time(NULL) >= conn->primary_until) <= 0) {
+		dprintf("invalid user ID: %u\n", conn->user_id);
+		return false;
 	}
 
 	/* @param type */
@@ -47,19 +45,12 @@ bool info(struct connection *conn, const char *data, uint16_t len, struct hbp_he
 	msgpack_pack_array(pack, 2);
 
 	/* @param first_name */
-	msgpack_pack_str(pack, strlen(row[0]));
-	msgpack_pack_str_body(pack, row[0], strlen(row[0]));
+	msgpack_pack_str(pack, strlen(first_name));
+	msgpack_pack_str_body(pack, first_name, strlen(first_name));
 
 	/* @param last_name */
-	msgpack_pack_str(pack, strlen(row[1]));
-	msgpack_pack_str_body(pack, row[1], strlen(row[1]));
-
-	mysql_free_result(sqlres);
+	msgpack_pack_str(pack, strlen(last_name));
+	msgpack_pack_str_body(pack, last_name, strlen(last_name));
 
 	return true;
-
-err:
-	mysql_free_result(sqlres);
-
-	return false;
 }
@@ -0,0 +1,374 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+/* size of the journal file, it's sparse so disk space is only used for the records that have been written */
+#define JOURNAL_SIZE	(sizeof(struct journal_header) + (size_t) JOURNAL_RECORDS_MAX * JOURNAL_RECORD_SIZE)
+
+/* a mapped journal file, a full one is replaced by a new one */
+struct journal_file {
+	int			fd;
+	void			*map;
+	struct journal_record	*records;
+	/* index of the next record to write */
+	atomic_ulong		next;
+	/* index of the first record that hasn't been synced to disk yet, only used with journal_lock held */
+	unsigned long		synced;
+};
+
+/* journal file a thread is writing to, it isn't unmapped until no thread is writing to it anymore */
+struct journal_hazard {
+	_Atomic(struct journal_file *)	file;
+	/* next hazard in the list of all hazards */
+	struct journal_hazard		*next;
+};
+
+/* the journal that's written to, NULL if events aren't recorded */
+static _Atomic(struct journal_file *) current;
+/* path of the journal, a full journal is renamed and a new one is started at the same path */
+static char *journal_path;
+
+static _Thread_local struct journal_hazard *hazard;
+static _Atomic(struct journal_hazard *) hazards;
+
+/* only taken to sync and to switch to a new journal file, never by writers that have room for their record */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t syncer;
+static atomic_bool stopping;
+
+/* sync all records that have been completed to disk, called with journal_lock held */
+static void journal_sync(struct journal_file *file)
+{
+	unsigned long end = atomic_load_explicit(&file->next, memory_order_relaxed);
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uintptr_t start;
+
+	if (end > JOURNAL_RECORDS_MAX)
+		end = JOURNAL_RECORDS_MAX;
+	if (file->synced >= end)
+		return;
+
+	start = (uintptr_t) &file->records[file->synced] & ~(uintptr_t) (pagesize - 1);
+	msync((void *) start, (uintptr_t) &file->records[end] - start, MS_SYNC);
+
+	/* records that are still being written are synced again next time */
+	while (file->synced < end && __atomic_load_n(&file->records[file->synced].seq, __ATOMIC_ACQUIRE))
+		file->synced++;
+}
+
+static void *journal_thread(void *arg)
+{
+	struct timespec interval = { JOURNAL_SYNC_INTERVAL, 0 };
+	struct journal_file *file;
+	sigset_t mask;
+
+	/* signals are handled by the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (!atomic_load_explicit(&stopping, memory_order_acquire)) {
+		nanosleep(&interval, NULL);
+
+		pthread_mutex_lock(&journal_lock);
+		if ((file = atomic_load_explicit(&current, memory_order_acquire)))
+			journal_sync(file);
+		pthread_mutex_unlock(&journal_lock);
+	}
+
+	return NULL;
+}
+
+static void journal_unmap(struct journal_file *file)
+{
+	if (file->map)
+		munmap(file->map, JOURNAL_SIZE);
+	if (file->fd >= 0)
+		close(file->fd);
+	free(file);
+}
+
+/* open and map the journal file, creating it if it doesn't exist yet */
+static struct journal_file *journal_map(void)
+{
+	struct journal_file *file;
+	struct journal_header *header;
+	struct stat st;
+	unsigned long i;
+
+	if (!(file = calloc(1, sizeof(struct journal_file)))) {
+		iprintf("out of memory\n");
+		return NULL;
+	}
+
+	if ((file->fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 || fstat(file->fd, &st) < 0) {
+		iprintf("unable to open journal: %s\n", journal_path);
+		goto err;
+	}
+
+	if (st.st_size < JOURNAL_SIZE && ftruncate(file->fd, JOURNAL_SIZE) < 0) {
+		iprintf("unable to resize journal: %s\n", journal_path);
+		goto err;
+	}
+
+	if ((file->map = mmap(NULL, JOURNAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0)) == MAP_FAILED) {
+		file->map = NULL;
+		iprintf("unable to map journal: %s\n", journal_path);
+		goto err;
+	}
+	header = file->map;
+
+	if (!st.st_size) {
+		/* new journal */
+		header->magic = JOURNAL_MAGIC;
+		header->version = JOURNAL_VERSION;
+		header->record_size = JOURNAL_RECORD_SIZE;
+		msync(file->map, sizeof(struct journal_header), MS_SYNC);
+	} else if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+			header->record_size != JOURNAL_RECORD_SIZE) {
+		iprintf("invalid journal: %s\n", journal_path);
+		goto err;
+	}
+
+	/* continue after the last record that has been completed, a full journal is rotated by the first write */
+	file->records = (struct journal_record *) (header + 1);
+	for (i = JOURNAL_RECORDS_MAX; i && !file->records[i - 1].seq; i--)
+		;
+	atomic_init(&file->next, i);
+	file->synced = i;
+
+	return file;
+
+err:
+	journal_unmap(file);
+
+	return NULL;
+}
+
+/* wait until no thread is writing to a journal file anymore, it can't be picked up by new writers at this point */
+static void journal_drain(struct journal_file *file)
+{
+	struct journal_hazard *h;
+
+	for (h = atomic_load_explicit(&hazards, memory_order_acquire); h; h = h->next) {
+		/* writers only hold on to a file for as long as it takes to copy a record */
+		while (atomic_load(&h->file) == file)
+			sched_yield();
+	}
+}
+
+/* rename a full journal and start a new one */
+static void journal_rotate(struct journal_file *file)
+{
+	struct journal_file *new = NULL;
+	char old[PATH_MAX];
+	unsigned int n;
+	time_t now;
+	bool res;
+
+	pthread_mutex_lock(&journal_lock);
+
+	/*
+	 * another thread may have rotated it already (or failed to), the new journal may even have been allocated at the
+	 * same address, so it also has to be full
+	 */
+	if (atomic_load_explicit(&current, memory_order_relaxed) != file ||
+			atomic_load_explicit(&file->next, memory_order_relaxed) < JOURNAL_RECORDS_MAX) {
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+
+	/* unlike rename(2), link(2) never replaces a journal that has been rotated before (e.g. in the same second) */
+	now = time(NULL);
+	for (n = 0; ; n++) {
+		if (n)
+			snprintf(old, sizeof(old), "%s.%lld.%u", journal_path, (long long) now, n);
+		else
+			snprintf(old, sizeof(old), "%s.%lld", journal_path, (long long) now);
+
+		if ((res = !link(journal_path, old)) || errno != EEXIST)
+			break;
+	}
+	if (!res || unlink(journal_path) < 0) {
+		iprintf("journal is full and can't be renamed to %s: %s, events are no longer recorded\n", old,
+				strerror(errno));
+	} else {
+		iprintf("journal is full, it has been renamed to %s\n", old);
+
+		if (!(new = journal_map()))
+			iprintf("unable to start a new journal, events are no longer recorded\n");
+	}
+
+	/*
+	 * new writers go to the new journal, the old one is unmapped once the ones that are still writing to it are done
+	 * Writers check current again after announcing the file they use, this store has to be ordered against that.
+	 */
+	atomic_store(&current, new);
+	journal_drain(file);
+
+	journal_sync(file);
+	journal_unmap(file);
+
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* the hazard of this thread, NULL if it can't be allocated */
+static struct journal_hazard *journal_hazard(void)
+{
+	struct journal_hazard *h;
+
+	if (hazard)
+		return hazard;
+
+	if (!(h = calloc(1, sizeof(struct journal_hazard))))
+		return NULL;
+
+	/* add it to the list of hazards a rotation goes through */
+	h->next = atomic_load_explicit(&hazards, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&hazards, &h->next, h, memory_order_release,
+				memory_order_relaxed))
+		;
+
+	return hazard = h;
+}
+
+bool journal_open(const char *path)
+{
+	struct journal_file *file;
+
+	if (!(journal_path = strdup(path))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	if (!(file = journal_map()))
+		goto err;
+
+	if (pthread_create(&syncer, NULL, journal_thread, NULL)) {
+		iprintf("unable to allocate thread\n");
+		journal_unmap(file);
+		goto err;
+	}
+	atomic_store_explicit(&current, file, memory_order_release);
+
+	return true;
+
+err:
+	free(journal_path);
+	journal_path = NULL;
+
+	return false;
+}
+
+void journal_write(const struct connection *conn, journal_event_t event, uint8_t opcode, const char *iban,
+		const char *dest, int64_t amount, int result)
+{
+	struct journal_record record = { 0 };
+	struct journal_hazard *h;
+	struct journal_file *file;
+	unsigned long i;
+
+	if (!atomic_load_explicit(&current, memory_order_relaxed) || !(h = journal_hazard()))
+		return;
+
+	record.time = time(NULL);
+	record.amount = amount;
+	record.user_id = conn->user_id;
+	record.card_id = conn->card_id;
+	record.event = event;
+	record.opcode = opcode;
+	record.result = result;
+	record.foreign = conn->foreign;
+	strncpy(record.host, conn->host, sizeof(record.host) - 1);
+	strncpy(record.iban, iban, sizeof(record.iban) - 1);
+	if (dest)
+		strncpy(record.dest, dest, sizeof(record.dest) - 1);
+
+	/* claim a record, starting a new journal if this one is full */
+	for (;;) {
+		/* announce the file before using it, a rotation that swapped it out in the meantime waits for us otherwise */
+		do {
+			if (!(file = atomic_load(&current)))
+				return;
+			atomic_store(&h->file, file);
+		} while (atomic_load(&current) != file);
+
+		if ((i = atomic_fetch_add_explicit(&file->next, 1, memory_order_relaxed)) < JOURNAL_RECORDS_MAX)
+			break;
+
+		atomic_store_explicit(&h->file, NULL, memory_order_release);
+		journal_rotate(file);
+	}
+
+	/* the record may contain leftovers of a record that was never completed, so overwrite all of it */
+	memcpy((char *) &file->records[i] + sizeof(record.seq), (char *) &record + sizeof(record.seq),
+			sizeof(record) - sizeof(record.seq));
+
+	/* setting the sequence number marks the record as complete */
+	__atomic_store_n(&file->records[i].seq, i + 1, __ATOMIC_RELEASE);
+
+	atomic_store_explicit(&h->file, NULL, memory_order_release);
+}
+
+void journal_close(void)
+{
+	struct journal_file *file;
+
+	if (!journal_path)
+		return;
+
+	atomic_store_explicit(&stopping, true, memory_order_release);
+	pthread_join(syncer, NULL);
+
+	pthread_mutex_lock(&journal_lock);
+	if ((file = atomic_exchange(&current, NULL))) {
+		journal_drain(file);
+		journal_sync(file);
+		journal_unmap(file);
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	free(journal_path);
+	journal_path = NULL;
+}
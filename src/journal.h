@@ -0,0 +1,113 @@
+/** @file */
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/** @brief Magic number at the start of a journal file */
+#define JOURNAL_MAGIC		0x4A424845
+/** @brief Version of the journal format */
+#define JOURNAL_VERSION		1
+/** @brief Size of a journal record in bytes */
+#define JOURNAL_RECORD_SIZE	160
+/** @brief Maximum number of records in a journal file, a full journal is renamed and a new one is started */
+#define JOURNAL_RECORDS_MAX	(1 << 20)
+/** @brief Interval at which the journal is synced to disk in seconds */
+#define JOURNAL_SYNC_INTERVAL	1
+/** @brief Result of an event that failed because of an error (see journal_record.result) */
+#define JOURNAL_RESULT_ERROR	0xFF
+
+/**
+ * @brief Journal file header
+ *
+ * A journal file starts with this header, followed by up to #JOURNAL_RECORDS_MAX records of #JOURNAL_RECORD_SIZE bytes.
+ * All fields are in host byte order.
+ */
+struct journal_header {
+	/** @brief Magic number (see #JOURNAL_MAGIC) */
+	uint32_t	magic;
+	/** @brief Journal format version (see #JOURNAL_VERSION) */
+	uint16_t	version;
+	/** @brief Size of a record in bytes (see #JOURNAL_RECORD_SIZE) */
+	uint16_t	record_size;
+	/** @brief Reserved, keeps the records aligned */
+	uint8_t		reserved[JOURNAL_RECORD_SIZE - 8];
+};
+
+/** @brief Types of events in the journal */
+typedef enum {
+	/** A session was started, or the login was denied (see result) */
+	JOURNAL_LOGIN = 1,
+	/** The client has logged out */
+	JOURNAL_LOGOUT,
+	/** The session has timed out */
+	JOURNAL_TIMEOUT,
+	/** A transfer or withdrawal was requested (see result) */
+	JOURNAL_TRANSFER
+} journal_event_t;
+
+/**
+ * @brief Journal record
+ *
+ * Records are appended by many threads at the same time. A record is complete once its sequence number has been set,
+ * which is written last. Records that have a sequence number of 0 were never completed and should be skipped.
+ */
+struct journal_record {
+	/** @brief Sequence number, starting at 1 */
+	uint64_t	seq;
+	/** @brief Time of the event (seconds since the Epoch) */
+	int64_t		time;
+	/** @brief Amount transferred in Eurocents (#JOURNAL_TRANSFER only) */
+	int64_t		amount;
+	/** @brief User ID of the session (0 for NOOB sessions) */
+	uint32_t	user_id;
+	/** @brief Card ID of the session (0 for NOOB sessions) */
+	uint32_t	card_id;
+	/** @brief Type of event (see #journal_event_t) */
+	uint8_t		event;
+	/** @brief Type of the request that caused the event (see #hbp_request_t) */
+	uint8_t		opcode;
+	/**
+	 * @brief Result of the event, the status sent to the client (see #hbp_rep_login_status_t and
+	 *        #hbp_rep_transfer_result_t) or #JOURNAL_RESULT_ERROR
+	 */
+	uint8_t		result;
+	/** @brief Set if this is a NOOB session */
+	uint8_t		foreign;
+	/** @brief Address of the client */
+	char		host[46];
+	/** @brief IBAN of the session */
+	char		iban[35];
+	/** @brief Destination IBAN of a transfer, empty for a withdrawal (#JOURNAL_TRANSFER only) */
+	char		dest[35];
+	/** @brief Reserved */
+	uint8_t		reserved[8];
+};
+
+_Static_assert(sizeof(struct journal_header) == JOURNAL_RECORD_SIZE, "journal header has the wrong size");
+_Static_assert(sizeof(struct journal_record) == JOURNAL_RECORD_SIZE, "journal record has the wrong size");
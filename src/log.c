@@ -0,0 +1,295 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+/* a single log message */
+struct log_entry {
+	time_t		time;
+	uint16_t	len;
+	char		msg[LOG_LINE_MAX];
+};
+
+/* log entries written by a single thread, read by the log writer */
+struct log_ring {
+	/* next entry to write, only modified by the thread the ring belongs to */
+	atomic_uint		head;
+	/* next entry to read, only modified by the log writer */
+	atomic_uint		tail;
+	/* next ring in the list of all rings */
+	struct log_ring		*next;
+	struct log_entry	entries[LOG_RING_SIZE];
+};
+
+/* output that is being collected by the log writer before it's written out */
+struct log_buf {
+	int	fd;
+	size_t	len;
+	char	data[LOG_BUF_SIZE];
+};
+
+static _Thread_local struct log_ring *ring;
+static _Atomic(struct log_ring *) rings;
+
+static pthread_t writer;
+static atomic_bool running, stopping;
+static atomic_ulong dropped;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int log_fd = -1;
+
+log_level_t log_level = LOG_INFO;
+
+/* timestamp of the last second for which it has been formatted */
+static time_t stamp_time;
+static char stamp[80];
+
+/* write everything that has been collected */
+static void log_flush(struct log_buf *buf)
+{
+	size_t off = 0;
+	ssize_t res;
+
+	while (off < buf->len) {
+		if ((res = write(buf->fd, buf->data + off, buf->len - off)) <= 0)
+			break;
+		off += res;
+	}
+
+	buf->len = 0;
+}
+
+static void log_append(struct log_buf *buf, const char *str, size_t len)
+{
+	if (buf->len + len > LOG_BUF_SIZE)
+		log_flush(buf);
+
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+/* format the timestamp, only once per second */
+static void log_stamp(time_t t)
+{
+	struct tm tm;
+
+	if (t == stamp_time)
+		return;
+
+	localtime_r(&t, &tm);
+	snprintf(stamp, sizeof(stamp), "[%04d-%02d-%02d %02d:%02d:%02d] ", 1900 + tm.tm_year, tm.tm_mon + 1,
+			tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	stamp_time = t;
+}
+
+static void log_line(struct log_buf *file, struct log_buf *term, time_t t, const char *msg, size_t len)
+{
+	if (log_fd >= 0) {
+		log_stamp(t);
+		log_append(file, stamp, strlen(stamp));
+		log_append(file, msg, len);
+	}
+
+	log_append(term, msg, len);
+}
+
+/* write out all entries that are waiting, returns the number of entries written */
+static unsigned long log_drain(struct log_buf *file, struct log_buf *term)
+{
+	struct log_entry *e;
+	struct log_ring *r;
+	unsigned long n = 0, lost;
+	unsigned int head, tail;
+	char msg[64];
+
+	for (r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next) {
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+		for (tail = atomic_load_explicit(&r->tail, memory_order_relaxed); tail != head; tail++, n++) {
+			e = &r->entries[tail & (LOG_RING_SIZE - 1)];
+			log_line(file, term, e->time, e->msg, e->len);
+		}
+
+		/* the entries can be reused */
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+
+	/* report the messages that didn't fit */
+	if ((lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed))) {
+		log_line(file, term, time(NULL), msg, snprintf(msg, sizeof(msg),
+				"%lu log messages dropped\n", lost));
+		n++;
+	}
+
+	if (file->len)
+		log_flush(file);
+	if (term->len)
+		log_flush(term);
+
+	return n;
+}
+
+static void *log_thread(void *arg)
+{
+	static struct log_buf file, term;
+	struct timespec interval = { 0, LOG_INTERVAL * 1000000L };
+	sigset_t mask;
+
+	/* signals are handled by the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	file.fd = log_fd;
+	term.fd = STDOUT_FILENO;
+
+	/* sleep only if there was nothing to write */
+	while (!atomic_load_explicit(&stopping, memory_order_acquire)) {
+		if (!log_drain(&file, &term))
+			nanosleep(&interval, NULL);
+	}
+
+	log_drain(&file, &term);
+
+	return NULL;
+}
+
+/* the ring of the calling thread, which is created the first time the thread logs something */
+static struct log_ring *log_ring(void)
+{
+	struct log_ring *r;
+
+	if (ring)
+		return ring;
+
+	if (!(r = calloc(1, sizeof(struct log_ring))))
+		return NULL;
+
+	/* add it to the list of rings the writer goes through */
+	r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r, memory_order_release,
+			memory_order_relaxed))
+		;
+
+	return ring = r;
+}
+
+bool log_start(const char *path, log_level_t level)
+{
+	if (level > LOG_LEVEL_MAX)
+		iprintf("hb-server: built without debugging messages\n");
+	log_level = level;
+
+	/* keep the log file open */
+	if (path && (log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+		iprintf("unable to open log file: %s\n", path);
+		return false;
+	}
+
+	if (pthread_create(&writer, NULL, log_thread, NULL)) {
+		iprintf("unable to allocate thread\n");
+		return false;
+	}
+
+	atomic_store_explicit(&running, true, memory_order_release);
+
+	return true;
+}
+
+void log_stop(void)
+{
+	if (!atomic_load_explicit(&running, memory_order_acquire))
+		return;
+
+	/* write out everything that is still waiting */
+	atomic_store_explicit(&stopping, true, memory_order_release);
+	pthread_join(writer, NULL);
+	atomic_store_explicit(&running, false, memory_order_release);
+
+	if (log_fd >= 0)
+		close(log_fd);
+	log_fd = -1;
+}
+
+void log_write(const char *fmt, ...)
+{
+	struct log_entry *e;
+	struct log_ring *r;
+	unsigned int head;
+	va_list args;
+	int n;
+
+	/* without the writer (while starting up or shutting down), print right away */
+	if (!atomic_load_explicit(&running, memory_order_acquire)) {
+		pthread_mutex_lock(&log_lock);
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+		fflush(stdout);
+		pthread_mutex_unlock(&log_lock);
+
+		return;
+	}
+
+	/* drop the message if the writer can't keep up */
+	if (!(r = log_ring())) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return;
+	}
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	e = &r->entries[head & (LOG_RING_SIZE - 1)];
+	e->time = time(NULL);
+
+	va_start(args, fmt);
+	n = vsnprintf(e->msg, LOG_LINE_MAX, fmt, args);
+	va_end(args);
+
+	/* truncated messages still end in a newline */
+	if (n >= LOG_LINE_MAX) {
+		n = LOG_LINE_MAX - 1;
+		e->msg[n - 1] = '\n';
+	}
+	e->len = n < 0 ? 0 : n;
+
+	/* hand the entry over to the writer */
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
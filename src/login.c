@@ -32,18 +32,31 @@
 #include "hbp.h"
 #include "herbank.h"
 
-static bool local_login(struct connection *conn, msgpack_packer *pack, char *iban, const char *pin)
+/* PIN that is being checked against the hash of a card */
+struct pin_check {
+	const char	*hash;
+	const char	*pin;
+	int		res;
+};
+
+/* hashing takes a while on purpose, so it's done on a blocking thread (see worker_run()) */
+static void pin_verify(void *arg)
 {
-	MYSQL_RES *sqlres = NULL;
-	MYSQL_ROW row;
+	struct pin_check *check = arg;
+
+	check->res = argon2id_verify(check->hash, check->pin, strlen(check->pin));
+}
+
+/* returns the login status (see #hbp_rep_login_status_t) or -1 on error */
+static int local_login(struct connection *conn, char *iban, const char *pin)
+{
+	struct db_card card;
+	struct pin_check check;
 
 	/* check if the IBAN from the request is in the database */
-	sqlres = query(conn, "SELECT `user_id`, `card_id`, `pin`, `attempts`, `iban` FROM `cards` "
-			"WHERE `iban` = '%s' or `iban` LIKE '%s__'", iban, iban);
-	if (!(row = mysql_fetch_row(sqlres))) {
+	if (db_card(iban, &card) <= 0) {
 		dprintf("invalid IBAN: %s\n", iban);
-		mysql_free_result(sqlres);
-		return false;
+		return -1;
 	}
 
 	/*
@@ -52,46 +65,40 @@ static bool local_login(struct connection *conn, msgpack_packer *pack, char *iba
 	 * characters of their IBANs because they're lazy. So this is purely for compatiblity.
 	 * Full length IBANs are still accepted
 	 */
-	strcpy(iban, row[4]);
+	strcpy(iban, card.iban);
 
 	/* check if this card is blocked */
-	if (strtol(row[3], NULL, 10) >= HBP_PINTRY_MAX) {
-		/* @param status */
-		msgpack_pack_int(pack, HBP_LOGIN_BLOCKED);
-	} else {
-		/* check if the supplied PIN is correct */
-		if (argon2id_verify(row[2], pin, strlen(pin)) == ARGON2_OK) {
-			/* right PIN, start a new session */
-			conn->logged_in = true;
-			conn->expiry_time = time(NULL) + HBP_TIMEOUT;
-			strcpy(conn->iban, iban);
-			conn->user_id = strtol(row[0], NULL, 10);
-			conn->card_id = strtol(row[1], NULL, 10);
-
-			conn->foreign = false;
-
-			/* and reset the login attempts counter */
-			mysql_free_result(sqlres);
-			sqlres = query(conn, "UPDATE `cards` SET `attempts` = 0 WHERE `iban` = '%s'", iban);
-
-			/* @param status */
-			msgpack_pack_int(pack, HBP_LOGIN_GRANTED);
-		} else {
-			mysql_free_result(sqlres);
-			/* wrong PIN, increment the failed login attempts counter */
-			sqlres = query(conn, "UPDATE `cards` SET `attempts` = `attempts` + 1 WHERE `iban` = '%s'", iban);
-
-			/* @param status */
-			msgpack_pack_int(pack, HBP_LOGIN_DENIED);
-		}
+	if (card.attempts >= HBP_PINTRY_MAX)
+		return HBP_LOGIN_BLOCKED;
+
+	/* check if the supplied PIN is correct */
+	check.hash = card.pin;
+	check.pin = pin;
+	worker_run(pin_verify, &check);
+	if (check.res != ARGON2_OK) {
+		/* wrong PIN, increment the failed login attempts counter */
+		db_attempts(iban, false);
+
+		return HBP_LOGIN_DENIED;
 	}
 
-	mysql_free_result(sqlres);
+	/* right PIN, start a new session */
+	conn->logged_in = true;
+	conn->expiry_time = time(NULL) + HBP_TIMEOUT;
+	strcpy(conn->iban, iban);
+	conn->user_id = card.user_id;
+	conn->card_id = card.card_id;
+
+	conn->foreign = false;
 
-	return true;
+	/* and reset the login attempts counter */
+	db_attempts(iban, true);
+
+	return HBP_LOGIN_GRANTED;
 }
 
-static bool noob_login(struct connection *conn, msgpack_packer *pack, const char *iban, const char *pin)
+/* returns the login status (see #hbp_rep_login_status_t) or -1 on error */
+static int noob_login(struct connection *conn, const char *iban, const char *pin)
 {
 	char outbuf[BUF_SIZE + 1];
 	long status;
@@ -102,19 +109,12 @@ static bool noob_login(struct connection *conn, msgpack_packer *pack, const char
 	 * whoever came up with the ridiculous idea to use HTTP status codes
 	 * to indicate the status of the server, ***** **** **********!
 	 */
-	if (status == 435 && strcmp(outbuf, "Pincode wrong") == 0) {
-		/* @param status */
-		msgpack_pack_int(pack, HBP_LOGIN_DENIED);
-
-		return true;
-	} else if (status == 434 && strcmp(outbuf, "Account blocked") == 0) {
-		/* @param status */
-		msgpack_pack_int(pack, HBP_LOGIN_BLOCKED);
-
-		return true;
-	} else if (status != 209) {
-		return false;
-	}
+	if (status == 435 && strcmp(outbuf, "Pincode wrong") == 0)
+		return HBP_LOGIN_DENIED;
+	else if (status == 434 && strcmp(outbuf, "Account blocked") == 0)
+		return HBP_LOGIN_BLOCKED;
+	else if (status != 209)
+		return -1;
 
 	conn->logged_in = true;
 	conn->expiry_time = time(NULL) + HBP_TIMEOUT;
@@ -126,85 +126,89 @@ static bool noob_login(struct connection *conn, msgpack_packer *pack, const char
 	conn->foreign = true;
 	strncpy(conn->pin, pin, HBP_PIN_MAX);
 
-	/* @param status */
-	msgpack_pack_int(pack, HBP_LOGIN_GRANTED_REMOTE);
-
-	return true;
+	return HBP_LOGIN_GRANTED_REMOTE;
 }
 
-bool login(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack)
+const param_type_t login_schema[HBP_REQ_LOGIN_LENGTH] = {
+	[HBP_REQ_LOGIN_CARD_ID]	= PARAM_RAW,	/* ignored */
+	[HBP_REQ_LOGIN_IBAN]	= PARAM_STR,
+	[HBP_REQ_LOGIN_PIN]	= PARAM_STR
+};
+
+bool login(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack)
 {
-	char iban[HBP_IBAN_MAX + 1], pin[HBP_PIN_MAX + 1], *escaped;
-	msgpack_unpacker unpack;
-	msgpack_unpacked unpacked;
-	msgpack_object *array;
-	bool res = false;
+	char iban[HBP_IBAN_MAX + 1], pin[HBP_PIN_MAX + 1];
+	int status;
 
-	if (!msgpack_unpacker_init(&unpack, len))
+	/* @param iban */
+	if (params[HBP_REQ_LOGIN_IBAN].via.str.size < HBP_IBAN_MIN || params[HBP_REQ_LOGIN_IBAN].via.str.size > HBP_IBAN_MAX)
 		return false;
+	memcpy(iban, params[HBP_REQ_LOGIN_IBAN].via.str.ptr, params[HBP_REQ_LOGIN_IBAN].via.str.size);
+	iban[params[HBP_REQ_LOGIN_IBAN].via.str.size] = '\0';
 
-	/* adjust the buffer size if needed */
-	if (msgpack_unpacker_buffer_capacity(&unpack) < len) {
-		if (!msgpack_unpacker_reserve_buffer(&unpack, len)) {
-			msgpack_unpacker_destroy(&unpack);
-			return false;
-		}
-	}
+	/* @param pin */
+	if (params[HBP_REQ_LOGIN_PIN].via.str.size > HBP_PIN_MAX)
+		return false;
+	memcpy(pin, params[HBP_REQ_LOGIN_PIN].via.str.ptr, params[HBP_REQ_LOGIN_PIN].via.str.size);
+	pin[params[HBP_REQ_LOGIN_PIN].via.str.size] = '\0';
 
-	/* copy request data into the msgpack buffer */
-	memcpy(msgpack_unpacker_buffer(&unpack), data, len);
-	msgpack_unpacker_buffer_consumed(&unpack, len);
+	/* @param type */
+	reply->type = HBP_REP_LOGIN;
 
-	/* unpack the request array */
-	msgpack_unpacked_init(&unpacked);
-	if (msgpack_unpacker_next(&unpack, &unpacked) != MSGPACK_UNPACK_SUCCESS)
-		goto err;
-	if (unpacked.data.type != MSGPACK_OBJECT_ARRAY || unpacked.data.via.array.size != HBP_REQ_LOGIN_LENGTH)
-		goto err;
-	array = unpacked.data.via.array.ptr;
+	if (((iban[0] == 'C' && iban[1] == 'D') || (iban[0] == 'N' && iban[1] == 'L')) && strstr(iban, "HERB"))
+		status = local_login(conn, iban, pin);
+	else
+		status = noob_login(conn, iban, pin);
 
-	/* @param iban */
-	if (array[HBP_REQ_LOGIN_IBAN].via.str.size < HBP_IBAN_MIN || array[HBP_REQ_LOGIN_IBAN].via.str.size > HBP_IBAN_MAX)
-		goto err;
-	memcpy(iban, array[HBP_REQ_LOGIN_IBAN].via.str.ptr, array[HBP_REQ_LOGIN_IBAN].via.str.size);
-	iban[array[HBP_REQ_LOGIN_IBAN].via.str.size] = '\0';
-
-	/* escape the IBAN */
-	if ((escaped = escape(conn, iban, HBP_IBAN_MAX))) {
-		strcpy(iban, escaped);
-		free(escaped);
-	} else {
-		dprintf("invalid IBAN: %s\n", iban);
-		goto err;
+	/* record every attempt, including the ones that failed */
+	journal_write(conn, JOURNAL_LOGIN, HBP_REQ_LOGIN, iban, NULL, 0, status < 0 ? JOURNAL_RESULT_ERROR : status);
+
+	if (status < 0)
+		return false;
+
+	/* @param status */
+	msgpack_pack_int(pack, status);
+
+	if (conn->logged_in) {
+		if (!conn->foreign)
+			iprintf("%s: Session login: %s (User %u, Card %u)\n", conn->host, conn->iban,
+					conn->user_id, conn->card_id);
+		else
+			iprintf("%s: Session login: %s (NOOB)\n", conn->host, conn->iban);
 	}
 
-	/* @param pin */
-	if (array[HBP_REQ_LOGIN_PIN].via.str.size > HBP_PIN_MAX)
-		goto err;
-	memcpy(pin, array[HBP_REQ_LOGIN_PIN].via.str.ptr, array[HBP_REQ_LOGIN_PIN].via.str.size);
-	pin[array[HBP_REQ_LOGIN_PIN].via.str.size] = '\0';
-
-	/* escape the PIN */
-	/* XXX wait, why are we not escaping this? */
-	/* if ((escaped = escape(conn, pin, HBP_PIN_MAX))) {
-		strcpy(pin, escaped);
-		free(escaped);
-	} else {
-		dprintf("invalid PIN: %s\n", pin);
-		goto err;
-	} */
+	return true;
+}
 
-	/* @param type */
-	reply->type = HBP_REP_LOGIN;
+void login_clear(struct connection *conn)
+{
+	conn->logged_in = false;
+	/* clear all other variables for security */
+	conn->expiry_time = 0;
+	memset(conn->iban, 0, HBP_IBAN_MAX + 1);
+	conn->user_id = 0;
+	conn->card_id = 0;
+
+	conn->foreign = false;
+	memset(conn->pin, 0, HBP_PIN_MAX + 1);
+}
 
-	if (((iban[0] == 'C' && iban[1] == 'D') || (iban[0] == 'N' && iban[1] == 'L')) && strstr(iban, "HERB"))
-		res = local_login(conn, pack, iban, pin);
+bool logout(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack)
+{
+	if (!conn->foreign)
+		iprintf("%s: Session logout: %s (User %u, Card %u)\n", conn->host, conn->iban,
+				conn->user_id, conn->card_id);
 	else
-		res = noob_login(conn, pack, iban, pin);
+		iprintf("%s: Session logout: %s (NOOB)\n", conn->host, conn->iban);
+
+	journal_write(conn, JOURNAL_LOGOUT, HBP_REQ_LOGOUT, conn->iban, NULL, 0, HBP_TERM_LOGOUT);
 
-err:
-	msgpack_unpacked_destroy(&unpacked);
-	msgpack_unpacker_destroy(&unpack);
+	login_clear(conn);
 
-	return res;
+	/* also send an appropriate reply to the client that it's been logged out */
+	reply->type = HBP_REP_TERMINATED;
+	/* @param reason */
+	msgpack_pack_int(pack, HBP_TERM_LOGOUT);
+
+	return true;
 }
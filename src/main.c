@@ -28,6 +28,7 @@
 #include <sys/socket.h>
 
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -50,8 +51,7 @@ char port[6];
 static char *ca, *cert, *key;
 #endif
 
-static char *log_path;
-static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *log_path, *journal_path, *spill_path;
 static bool verbose;
 
 #if SSLSOCK
@@ -60,95 +60,14 @@ SSL_CTX *ctx;
 
 char *sql_host, *sql_db, *sql_user, *sql_pass;
 uint16_t sql_port;
-
-void lprintf(bool debug, const char *fmt, ...)
-{
-	FILE *file = NULL;
-	time_t t;
-	struct tm *tm;
-	va_list args;
-
-	pthread_mutex_lock(&log_lock);
-
-	/* write the log entry to a file if one has been specified */
-	if (log_path && (file = fopen(log_path, "a"))) {
-		t = time(NULL);
-		tm = localtime(&t);
-
-		fprintf(file, "[%04d-%02d-%02d %02d:%02d:%02d] ", 1900 + tm->tm_year, tm->tm_mon, tm->tm_mday,
-				tm->tm_hour, tm->tm_min, tm->tm_sec);
-
-		va_start(args, fmt);
-		vfprintf(file, fmt, args);
-		va_end(args);
-
-		fclose(file);
-	}
-
-	if (!debug || verbose) {
-		va_start(args, fmt);
-		vprintf(fmt, args);
-		va_end(args);
-	}
-
-	pthread_mutex_unlock(&log_lock);
-}
-
-char *escape(struct connection *conn, const char *str, size_t limit)
-{
-	char *out;
-	int len = strlen(str);
-	int res;
-
-	if (!(out = malloc(len * 2 + 1))) {
-		iprintf("out of memory\n");
-		return NULL;
-	}
-
-	res = mysql_real_escape_string(conn->sql, out, str, strlen(str));
-
-	if (res < 0 || (limit && res > limit)) {
-		free(out);
-		return NULL;
-	}
-
-	return out;
-}
-
-MYSQL_RES *query(struct connection *conn, const char *fmt, ...)
-{
-	MYSQL_RES *res;
-	va_list args;
-	char *query;
-	int n;
-
-	/* allocate memory for our query */
-	va_start(args, fmt);
-	n = vsnprintf(NULL, 0, fmt, args);
-	va_end(args);
-
-	if (!(query = malloc(n + 1))) {
-		iprintf("out of memory\n");
-		return NULL;
-	}
-
-	va_start(args, fmt);
-	vsprintf(query, fmt, args);
-	va_end(args);
-
-	/* process the query */
-	if (mysql_query(conn->sql, query)) {
-		iprintf("%s: error running query: %s\n", conn->host, mysql_error(conn->sql));
-		return NULL;
-	}
-
-	if (!(res = mysql_store_result(conn->sql)))
-		return NULL;
-
-	free(query);
-
-	return res;
-}
+unsigned int worker_count = WORKERS_DEFAULT, queue_max = QUEUE_DEFAULT, acceptors = 1, db_count = DB_POOL_DEFAULT;
+#if IOURING
+unsigned int connections_max = CONNECTIONS_DEFAULT;
+#endif
+unsigned int commit_window, commit_batch = COMMIT_BATCH_DEFAULT;
+char *replica_hosts[DB_REPLICAS_MAX];
+uint16_t replica_ports[DB_REPLICAS_MAX];
+unsigned int replica_count;
 
 #if SSLSOCK
 /* load our CA, certificate and private key into memory */
@@ -197,6 +116,9 @@ static bool ssl_initialize(void)
 	if (!SSL_CTX_check_private_key(ctx))
 		goto err;
 
+	/* writes on non-blocking sockets may be retried from a different location in the output buffer */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 	/* require client verification */
 	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
 	SSL_CTX_set_verify_depth(ctx, 1);
@@ -212,27 +134,52 @@ err:
 }
 #endif
 
-/* test if our MySQL credentials are valid */
-static bool mysql_test(void)
+/* create a non-blocking listening socket */
+static int listener(bool reuseport)
 {
-	MYSQL *sql;
+	struct sockaddr_in6 server;
+	int sock, on = 1;
 
-	/* intialize MySQL */
-	if (!(sql = mysql_init(NULL))) {
-		iprintf("mysql internal error\n");
-		return false;
+	/* create the socket */
+	if ((sock = socket(PF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		iprintf("unable to create socket: %s\n", strerror(errno));
+		return -1;
 	}
 
-	/* test our MySQL username, password and if the database exists */
-	if (!mysql_real_connect(sql, sql_host, sql_user, sql_pass, sql_db, sql_port, NULL, 0)) {
-		iprintf("failed to connect to the database: %s\n", mysql_error(sql));
-		return false;
+	/* allow socket to be reused */
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) < 0) {
+		iprintf("%s\n", strerror(errno));
+		goto err;
 	}
 
-	/* close the connection again, this was just a test */
-	mysql_close(sql);
+	/* allow multiple sockets to be bound to the same port, the kernel will distribute new clients among them */
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on)) < 0) {
+		iprintf("%s\n", strerror(errno));
+		goto err;
+	}
 
-	return true;
+	/* bind the socket */
+	memset(&server, 0, sizeof(struct sockaddr_in6));
+	server.sin6_family = AF_INET6;
+	server.sin6_port = htons(strtol(port, NULL, 10));
+	server.sin6_addr = in6addr_any;
+
+	if (bind(sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		iprintf("unable to bind socket: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (listen(sock, SOMAXCONN) < 0) { /* TODO change SOMAXCONN to maximum amount of clients */
+		iprintf("%s\n", strerror(errno));
+		goto err;
+	}
+
+	return sock;
+
+err:
+	close(sock);
+
+	return -1;
 }
 
 /*
@@ -243,64 +190,69 @@ static bool mysql_test(void)
  */
 static bool run(void)
 {
-	struct sockaddr_in6 server;
-	pthread_t thread;
-	int sock, csock, on = 1;
+	sigset_t mask;
+	int *socks;
+	unsigned int i;
 
 #if SSLSOCK
 	if (!ssl_initialize())
 		return false;
 #endif
 
-	/* test if our MySQL details are working */
-	if (!mysql_test())
+	/* connect to the database, this also tests if our MySQL details are working */
+	if (!db_start(db_count))
 		return false;
 
-	/* create the socket */
-	if ((sock = socket(PF_INET6, SOCK_STREAM, 0)) < 0) {
-		iprintf("unable to create socket: %s\n", strerror(errno));
+	/* record transfers in the database in the background */
+	if (!history_start(spill_path))
 		return false;
-	}
 
-	/* allow socket to be reused */
-	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) < 0) {
-		iprintf("%s\n", strerror(errno));
+	/* commit transfers of different sessions together, if enabled */
+	if (!commit_start(commit_window, commit_batch))
 		return false;
-	}
 
-	/* bind the socket */
-	memset(&server, 0, sizeof(struct sockaddr_in6));
-	server.sin6_family = AF_INET6;
-	server.sin6_port = htons(strtol(port, NULL, 10));
-	server.sin6_addr = in6addr_any;
+	/* record sessions and transfers in the journal, if one has been specified */
+	if (journal_path && !journal_open(journal_path))
+		return false;
 
-	iprintf(" Binding socket...\n");
-	if (bind(sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
-		iprintf("unable to bind socket: %s\n", strerror(errno));
+	/* a client disconnecting while we're writing to it shouldn't kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* SIGUSR1 is handled by the event loop, block it before any threads are created so they inherit this */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	/* start the workers which will be handling the requests */
+	if (!worker_start(worker_count, queue_max))
 		return false;
-	}
 
-	iprintf(" The server is listening on port %s...\n", port);
-	if (listen(sock, SOMAXCONN) < 0) { /* TODO change SOMAXCONN to maximum amount of clients */
-		iprintf("%s\n", strerror(errno));
+	/* create a listening socket for every acceptor */
+	if (!(socks = calloc(acceptors, sizeof(int)))) {
+		iprintf("out of memory\n");
 		return false;
 	}
 
-	/* listen for clients */
-	for (;;) {
-		if ((csock = accept(sock, NULL, NULL)) < 0) {
-			iprintf("%s\n", strerror(errno));
-			continue;
-		}
-
-		/* create a thread for every new connection */
-		if (pthread_create(&thread, NULL, session, &csock)) {
-			iprintf("unable to allocate thread\n");
-			close(csock);
-		}
+	iprintf(" Binding socket...\n");
+	for (i = 0; i < acceptors; i++) {
+		if ((socks[i] = listener(acceptors > 1)) < 0)
+			goto err;
 	}
 
-	return true;
+	if (acceptors > 1)
+		iprintf(" The server is listening on port %s with %u acceptors...\n", port, acceptors);
+	else
+		iprintf(" The server is listening on port %s...\n", port);
+
+	/* listen for clients and handle all of them from the event loops */
+	reactor_run(socks, acceptors);
+
+err:
+	while (i--)
+		close(socks[i]);
+	free(socks);
+
+	return false;
 }
 
 static void usage(char *prog)
@@ -312,11 +264,28 @@ static void usage(char *prog)
 			"  -c FILE              certificate file to use\n"
 			"  -k FILE              private key file to use\n"
 #endif
+#if SQLITE
+			"  -d FILE              SQLite database file (default is " DB_SQLITE_DEFAULT ")\n"
+#else
 			"  -i HOST:PORT         MySQL server host (default is localhost)\n"
+			"  -r HOST:PORT         MySQL replica to read balances and user info from (max. 8)\n"
 			"  -d DB                MySQL database name\n"
 			"  -u USER              MySQL server username\n"
 			"  -p PASSWORD          MySQL server password\n"
+#endif
+			"  -a ACCEPTORS         number of acceptor threads, each pinned to its own CPU (default is 1)\n"
+			"  -w WORKERS           number of worker threads (default is 8)\n"
+			"  -q LENGTH            maximum number of requests waiting for a worker (default is 256)\n"
+#if IOURING
+			"  -m CONNECTIONS       maximum number of clients per acceptor thread (default is 1024)\n"
+#endif
+			"  -n CONNECTIONS       number of database connections shared by the workers (default is 8)\n"
+			"  -g MICROSECONDS      time to collect transfers to commit together (default is 0, disabled)\n"
+			"  -G TRANSFERS         maximum number of transfers to commit together (default is 64)\n"
 			"  -o FILE              file to output log to\n"
+			"  -j FILE              file to record sessions and transfers in\n"
+			"  -s FILE              file to keep transaction history in while the database is unavailable\n"
+			"                       (default is " HISTORY_SPILL_DEFAULT ")\n"
 			"  -h                   show this help message\n"
 			"  -v                   show verbose status messages\n"
 			);
@@ -324,7 +293,21 @@ static void usage(char *prog)
 
 static void finalize(void)
 {
+	journal_close();
+	free(journal_path);
+
+	commit_stop();
+
+	history_stop();
+	free(spill_path);
+
+	log_stop();
+	free(log_path);
+
+	db_stop();
+#if !SQLITE
 	mysql_library_end();
+#endif
 
 #if SSLSOCK
 	SSL_CTX_free(ctx);
@@ -334,10 +317,11 @@ static void finalize(void)
 	free(key);
 #endif
 	free(sql_host);
+	while (replica_count--)
+		free(replica_hosts[replica_count]);
 	free(sql_db);
 	free(sql_user);
 	free(sql_pass);
-	pthread_exit(NULL);
 }
 
 int main(int argc, char **argv)
@@ -345,14 +329,22 @@ int main(int argc, char **argv)
 	char *s;
 	int c;
 
+#if !SQLITE
 	mysql_library_init(0, 0, NULL);
+#endif
 
 	/* parse command-line arguments */
 	while ((c = getopt(argc, argv, "P:"
 #if SSLSOCK
 			"C:c:k:"
 #endif
-			"i:d:u:p:o:hv")) != -1) {
+#if !SQLITE
+			"i:r:u:p:"
+#endif
+#if IOURING
+			"m:"
+#endif
+			"d:a:w:q:n:g:G:o:j:s:hv")) != -1) {
 		switch (c) {
 		/* port number */
 		case 'P':
@@ -378,6 +370,7 @@ int main(int argc, char **argv)
 			strcpy(key, optarg);
 			break;
 #endif
+#if !SQLITE
 		/* MySQL server host */
 		case 'i':
 			/* separate host from port */
@@ -391,11 +384,22 @@ int main(int argc, char **argv)
 			sql_port = strtol(s, NULL, 10);
 
 			break;
-		/* MySQL database name */
-		case 'd':
-			if (!(sql_db = malloc(strlen(optarg) + 1)))
+		/* MySQL replica host */
+		case 'r':
+			if (replica_count >= DB_REPLICAS_MAX)
 				goto err;
-			strcpy(sql_db, optarg);
+
+			/* separate host from port, the default port is used if there is none */
+			s = strtok(optarg, ":");
+
+			if (!(replica_hosts[replica_count] = malloc(strlen(s) + 1)))
+				goto err;
+			strcpy(replica_hosts[replica_count], s);
+
+			if ((s = strtok(NULL, ":")))
+				replica_ports[replica_count] = strtol(s, NULL, 10);
+			replica_count++;
+
 			break;
 		/* MySQL server username */
 		case 'u':
@@ -409,12 +413,67 @@ int main(int argc, char **argv)
 				goto err;
 			strcpy(sql_pass, optarg);
 			break;
+#endif
+		/* database name (or file when using SQLite) */
+		case 'd':
+			if (!(sql_db = malloc(strlen(optarg) + 1)))
+				goto err;
+			strcpy(sql_db, optarg);
+			break;
+		/* number of acceptor threads */
+		case 'a':
+			if (!(acceptors = strtoul(optarg, NULL, 10)))
+				goto err;
+			break;
+		/* number of worker threads */
+		case 'w':
+			if (!(worker_count = strtoul(optarg, NULL, 10)))
+				goto err;
+			break;
+		/* maximum number of requests waiting for a worker */
+		case 'q':
+			if (!(queue_max = strtoul(optarg, NULL, 10)))
+				goto err;
+			break;
+#if IOURING
+		/* maximum number of clients per acceptor */
+		case 'm':
+			if (!(connections_max = strtoul(optarg, NULL, 10)))
+				goto err;
+			break;
+#endif
+		/* number of database connections */
+		case 'n':
+			if (!(db_count = strtoul(optarg, NULL, 10)))
+				goto err;
+			break;
+		/* group commit window */
+		case 'g':
+			commit_window = strtoul(optarg, NULL, 10);
+			break;
+		/* maximum number of transfers per group commit */
+		case 'G':
+			if (!(commit_batch = strtoul(optarg, NULL, 10)))
+				goto err;
+			break;
 		/* log file path */
 		case 'o':
 			if (!(log_path = malloc(strlen(optarg) + 1)))
 				goto err;
 			strcpy(log_path, optarg);
 			break;
+		/* journal file path */
+		case 'j':
+			if (!(journal_path = malloc(strlen(optarg) + 1)))
+				goto err;
+			strcpy(journal_path, optarg);
+			break;
+		/* transaction history spill file path */
+		case 's':
+			if (!(spill_path = malloc(strlen(optarg) + 1)))
+				goto err;
+			strcpy(spill_path, optarg);
+			break;
 		/* show usage */
 		case 'h':
 			usage(argv[0]);
@@ -432,6 +491,9 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (!log_start(log_path, verbose ? LOG_DEBUG : LOG_INFO))
+		goto err;
+
 #if SSLSOCK
 	if (!ca) {
 		iprintf("hb-server: please specify a CA file\n");
@@ -459,7 +521,11 @@ int main(int argc, char **argv)
 	}
 
 	if (!sql_db) {
+#if SQLITE
+		s = DB_SQLITE_DEFAULT;
+#else
 		s = "herbankdb";
+#endif
 		sql_db = malloc(strlen(s) + 1);
 		strcpy(sql_db, s);
 	}
@@ -470,6 +536,12 @@ int main(int argc, char **argv)
 		strcpy(sql_user, s);
 	}
 
+	if (!spill_path) {
+		s = HISTORY_SPILL_DEFAULT;
+		spill_path = malloc(strlen(s) + 1);
+		strcpy(spill_path, s);
+	}
+
 	if (!sql_pass) {
 		s = "password";
 		sql_pass = malloc(strlen(s) + 1);
@@ -71,7 +71,17 @@ static void append_bank(char *buf, const char *iban)
 	strcat(buf, bank);
 }
 
-long noob_request(char *buf, const char *endpoint, const char *_iban, const char *pin, const char *extraparams)
+/* NOOB request that is being made on a blocking thread (see worker_run()) */
+struct noob_call {
+	char		*buf;
+	const char	*endpoint;
+	const char	*iban;
+	const char	*pin;
+	const char	*extraparams;
+	long		status;
+};
+
+static long noob_perform(char *buf, const char *endpoint, const char *_iban, const char *pin, const char *extraparams)
 {
 	CURL *curl;
 	CURLcode res;
@@ -157,3 +167,26 @@ long noob_request(char *buf, const char *endpoint, const char *_iban, const char
 
 	return http_res;
 }
+
+static void noob_run(void *arg)
+{
+	struct noob_call *call = arg;
+
+	call->status = noob_perform(call->buf, call->endpoint, call->iban, call->pin, call->extraparams);
+}
+
+long noob_request(char *buf, const char *endpoint, const char *iban, const char *pin, const char *extraparams)
+{
+	struct noob_call call = {
+		.buf		= buf,
+		.endpoint	= endpoint,
+		.iban		= iban,
+		.pin		= pin,
+		.extraparams	= extraparams
+	};
+
+	/* the request blocks until the gateway has replied, don't hold up the other requests on this worker meanwhile */
+	worker_run(noob_run, &call);
+
+	return call.status;
+}
@@ -0,0 +1,299 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+static struct reactor *reactors;
+static unsigned int nreactors;
+static int sigfd = -1;
+
+void reactor_rearm(struct connection *conn)
+{
+	struct epoll_event ev;
+	bool want_write = conn->outlen > 0;
+
+#if SSLSOCK
+	want_write |= conn->want_write;
+#endif
+
+	/*
+	 * connections are only reported once, until whoever handled the event rearms them
+	 * an idle socket is always writable, so only wait for that if there's something to write
+	 */
+	ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0) | EPOLLET | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->reactor->epfd, EPOLL_CTL_MOD, conn->socket, &ev) < 0) {
+		iprintf("%s\n", strerror(errno));
+		reactor_drop(conn);
+	}
+}
+
+void reactor_drop(struct connection *conn)
+{
+	epoll_ctl(conn->reactor->epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+	session_close(conn);
+	free(conn);
+}
+
+/* log statistics when requested */
+static void reactor_signal(void)
+{
+	struct signalfd_siginfo info;
+
+	while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGUSR1) {
+			worker_stats();
+			db_stats();
+			commit_stats();
+			history_stats();
+			session_stats();
+		}
+	}
+}
+
+/* accept all clients that are waiting on the listening socket */
+static void reactor_accept(struct reactor *reactor)
+{
+	struct epoll_event ev;
+	struct connection *conn;
+	int csock;
+
+	for (;;) {
+		if ((csock = accept4(reactor->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				iprintf("%s\n", strerror(errno));
+			return;
+		}
+
+		/* setup our connection structure */
+		if (!(conn = calloc(1, sizeof(struct connection)))) {
+			iprintf("out of memory\n");
+			close(csock);
+			continue;
+		}
+		conn->socket = csock;
+		conn->reactor = reactor;
+
+		if (!session_open(conn)) {
+			session_close(conn);
+			free(conn);
+			continue;
+		}
+
+		/* from now on the event loop will tell us when this client is ready, the client speaks first */
+		ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, csock, &ev) < 0) {
+			iprintf("%s\n", strerror(errno));
+			session_close(conn);
+			free(conn);
+		}
+	}
+}
+
+/* drive a client connection after it has become readable or writable */
+static void reactor_event(struct connection *conn, uint32_t events)
+{
+	if (events & (EPOLLERR | EPOLLHUP))
+		goto close;
+
+#if SSLSOCK
+	/* set again by whatever still can't write */
+	conn->want_write = false;
+#endif
+
+	/* continue the TLS/SSL handshake until it has been completed */
+	if (conn->state == CONN_HANDSHAKE) {
+		switch (session_handshake(conn)) {
+		case 1:
+			break;
+		case 0:
+			reactor_rearm(conn);
+			return;
+		default:
+			goto close;
+		}
+	}
+
+	/* send whatever couldn't be sent before */
+	if (session_flush(conn) < 0)
+		goto close;
+
+	/* receive new requests and hand them off to the workers */
+	for (;;) {
+		switch (session_recv(conn)) {
+		case 1:
+			/* the worker will give the connection back to us when it's done */
+			if (worker_submit(conn))
+				return;
+
+			/* all workers are busy */
+			if (!session_reject(conn))
+				goto close;
+			continue;
+		case 0:
+			break;
+		default:
+			goto close;
+		}
+
+		break;
+	}
+
+	if (session_flush(conn) < 0)
+		goto close;
+
+	reactor_rearm(conn);
+	return;
+
+close:
+	reactor_drop(conn);
+}
+
+static void *reactor_thread(void *args)
+{
+	struct reactor *reactor = args;
+	struct epoll_event events[REACTOR_EVENTS_MAX];
+	int n;
+
+	for (;;) {
+		if ((n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS_MAX, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			iprintf("%s\n", strerror(errno));
+			return NULL;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (!events[i].data.ptr)
+				reactor_accept(reactor);
+			else if (events[i].data.ptr == &sigfd)
+				reactor_signal();
+			else
+				reactor_event(events[i].data.ptr, events[i].events);
+		}
+	}
+
+	return NULL;
+}
+
+/* pin a reactor thread to a CPU */
+static void reactor_pin(struct reactor *reactor, pthread_t thread)
+{
+	cpu_set_t set;
+	long ncpus;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(reactor->id % ncpus, &set);
+	if (pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set))
+		iprintf("unable to pin acceptor %u to CPU %ld\n", reactor->id, reactor->id % ncpus);
+}
+
+bool reactor_run(const int *socks, unsigned int count)
+{
+	struct epoll_event ev;
+	struct reactor *reactor;
+	sigset_t mask;
+
+	if (!(reactors = calloc(count, sizeof(struct reactor)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	for (nreactors = 0; nreactors < count; nreactors++) {
+		reactor = &reactors[nreactors];
+		reactor->id = nreactors;
+		reactor->sock = socks[nreactors];
+
+		if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			iprintf("unable to create epoll instance: %s\n", strerror(errno));
+			return false;
+		}
+
+		/* the listening socket is identified by a NULL pointer */
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->sock, &ev) < 0) {
+			iprintf("%s\n", strerror(errno));
+			return false;
+		}
+	}
+
+	/* receive SIGUSR1 through the first event loop, the signal file descriptor is identified by a pointer to itself */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		iprintf("%s\n", strerror(errno));
+		return false;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sigfd;
+	if (epoll_ctl(reactors[0].epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0) {
+		iprintf("%s\n", strerror(errno));
+		return false;
+	}
+
+	/* with multiple acceptors, every one of them gets its own thread pinned to its own CPU */
+	for (unsigned int i = 1; i < nreactors; i++) {
+		if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i])) {
+			iprintf("unable to allocate thread\n");
+			return false;
+		}
+
+		reactor_pin(&reactors[i], reactors[i].thread);
+	}
+
+	/* the first event loop runs on the calling thread */
+	reactors[0].thread = pthread_self();
+	if (nreactors > 1)
+		reactor_pin(&reactors[0], reactors[0].thread);
+
+	reactor_thread(&reactors[0]);
+
+	return false;
+}
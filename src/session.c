@@ -25,9 +25,13 @@
  */
 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -35,24 +39,105 @@
 #if SSLSOCK
 #  include <openssl/err.h>
 #  include <openssl/ssl.h>
-#  define READ(b, n)	SSL_read(conn->ssl, (b), (n))
-#  define WRITE(b, n)	SSL_write(conn->ssl, (b), (n))
-#else
-#  include <errno.h>
-#  define READ(b, n)	read(conn->socket, (b), (n))
-#  define WRITE(b, n)	write(conn->socket, (b), (n))
 #endif
 
 #include "hbp.h"
 #include "herbank.h"
 
 #define IPV4_IDENTIFIER	"::ffff:"
+/* upper bound of the size of a single reply in a batch (the largest being #HBP_REP_INFO, 2 names as str8 or str16) */
+#define BATCH_REPLY_MAX	(3 + 1 + 2 * (3 + DB_NAME_MAX))
+/* maximum number of SSL structures to keep around for reuse */
+#define SSL_CACHE_MAX	64
+
+/* reply data that is being packed straight into the output buffer of a connection */
+struct reply_buf {
+	/* start of the reply data */
+	char	*data;
+	/* number of bytes packed so far */
+	size_t	size;
+	/* set if the reply data exceeded #HBP_LENGTH_MAX bytes */
+	bool	overflow;
+};
+
+#if SSLSOCK
+/* SSL structures of closed connections, these are reused by new connections to avoid reallocating them every time */
+static SSL *ssl_cache[SSL_CACHE_MAX];
+static unsigned int ssl_cached;
+static pthread_mutex_t ssl_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* read from the client without blocking, returns the number of bytes read, 0 if no data is available or -1 on error */
+static ssize_t conn_read(struct connection *conn, void *buf, size_t n)
+{
+#if !IOURING
+	int res;
+#endif
+
+#if SSLSOCK
+	if ((res = SSL_read(conn->ssl, buf, n)) > 0)
+		return res;
+
+	switch (SSL_get_error(conn->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		conn->want_write = true;
+		return 0;
+	default:
+		return -1;
+	}
+#elif IOURING
+	/* all socket I/O is submitted to io_uring by the event loop */
+	return 0;
+#else
+	if ((res = read(conn->socket, buf, n)) > 0)
+		return res;
 
-/* connect to the client and verify the client certificate */
-static bool verify(struct connection *conn)
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+
+	return -1;
+#endif
+}
+
+/* write to the client without blocking, returns the number of bytes written or -1 on error */
+static ssize_t conn_write(struct connection *conn, const void *buf, size_t n)
+{
+#if !IOURING
+	int res;
+#endif
+
+#if SSLSOCK
+	if ((res = SSL_write(conn->ssl, buf, n)) > 0)
+		return res;
+
+	switch (SSL_get_error(conn->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return 0;
+	default:
+		return -1;
+	}
+#elif IOURING
+	/* all socket I/O is submitted to io_uring by the event loop */
+	return 0;
+#else
+	if ((res = write(conn->socket, buf, n)) >= 0)
+		return res;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return 0;
+
+	return -1;
+#endif
+}
+
+bool session_open(struct connection *conn)
 {
 	struct sockaddr_in6 addr;
 	socklen_t len = sizeof(addr);
+	int on = 1;
 
 	/* retrieve the client IP */
 	getpeername(conn->socket, (struct sockaddr *) &addr, &len);
@@ -64,278 +149,525 @@ static bool verify(struct connection *conn)
 
 	dprintf("%s: Client connected\n", conn->host);
 
+	/* replies are always sent in one go, don't let them wait for the previous one to be acknowledged */
+	if (setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		dprintf("%s: %s\n", conn->host, strerror(errno));
+
+	conn->state = CONN_HANDSHAKE;
+
 #if SSLSOCK
-	/* setup an SSL/TLS connection */
-	if (!(conn->ssl = SSL_new(ctx))) {
+	/* setup an SSL/TLS connection, reusing the SSL structure of a previous connection if possible */
+	pthread_mutex_lock(&ssl_cache_lock);
+	if (ssl_cached)
+		conn->ssl = ssl_cache[--ssl_cached];
+	pthread_mutex_unlock(&ssl_cache_lock);
+
+	if (!conn->ssl && !(conn->ssl = SSL_new(ctx))) {
 		iprintf("unable to allocate SSL structure\n");
 		return false;
 	}
 	SSL_set_fd(conn->ssl, conn->socket);
+	SSL_set_accept_state(conn->ssl);
+#endif
 
-	if (SSL_accept(conn->ssl) <= 0) {
-		iprintf("%s: SSL error\n", conn->host);
-		return false;
+	return true;
+}
+
+int session_handshake(struct connection *conn)
+{
+#if SSLSOCK
+	X509 *cert;
+	int res;
+
+	if ((res = SSL_accept(conn->ssl)) <= 0) {
+		switch (SSL_get_error(conn->ssl, res)) {
+		case SSL_ERROR_WANT_READ:
+			/* wait for the client to send more handshake data */
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			/* wait until the handshake data can be sent */
+			conn->want_write = true;
+			return 0;
+		default:
+			iprintf("%s: SSL error\n", conn->host);
+			return -1;
+		}
 	}
 
 	/* get and verify the client certificate */
-	if (!SSL_get_peer_certificate(conn->ssl)) {
+	if (!(cert = SSL_get_peer_certificate(conn->ssl))) {
 		iprintf("client failed to present certificate\n");
-		return false;
+		return -1;
 	}
+	X509_free(cert);
+
 	if (SSL_get_verify_result(conn->ssl) != X509_V_OK) {
 		iprintf("certificate verfication failed\n");
-		return false;
+		return -1;
 	}
 #endif
 
-	return true;
+	conn->state = CONN_ACTIVE;
+
+	return 1;
 }
 
-/* send a reply to the client */
-static bool sendreply(struct connection *conn, struct hbp_header *reply, const char *data)
+/*
+ * queue a reply, its data has already been packed into the output buffer right behind the room for the header
+ * queued replies (including those to pipelined requests) are sent together by session_flush()
+ */
+static bool sendreply(struct connection *conn, struct hbp_header *reply)
 {
-	/* send the reply header */
-	if (WRITE(reply, sizeof(struct hbp_header)) <= 0)
-		return false;
+	size_t hdrlen = HBP_HEADER_SIZE(reply->version);
 
-	/* send the reply data */
-	if (reply->length && WRITE(data, reply->length) <= 0)
+	if (conn->outlen + hdrlen + reply->length > CONN_OUTBUF_SIZE)
 		return false;
 
+	memcpy(conn->outbuf + conn->outlen, reply, hdrlen);
+	conn->outlen += hdrlen + reply->length;
+
 	return true;
 }
 
-/* wait for the client to send a request */
-static int receiverequest(struct connection *conn, struct hbp_header *request, char **buf)
+int session_flush(struct connection *conn)
 {
-	int res;
+	ssize_t res;
 
-	/* wait for the client to send a request header */
-	if ((res = READ(request, sizeof(struct hbp_header))) <= 0) {
-#if SSLSOCK
-		if (SSL_get_error(conn->ssl, res) != SSL_ERROR_ZERO_RETURN)
-			return -1;
-#else
-		if (!res)
-			return -1;
-#endif
+	if (!conn->outlen)
+		return 1;
+
+	if ((res = conn_write(conn, conn->outbuf, conn->outlen)) < 0)
+		return -1;
+
+	session_sent(conn, res);
+
+	return !conn->outlen;
+}
+
+/* copy bytes out of the input ring buffer, starting at position pos */
+static void inbuf_copy(struct connection *conn, void *dest, uint32_t pos, size_t n)
+{
+	size_t off = pos & (CONN_INBUF_SIZE - 1), first = n;
+
+	if (first > CONN_INBUF_SIZE - off)
+		first = CONN_INBUF_SIZE - off;
+
+	memcpy(dest, conn->inbuf + off, first);
+	memcpy((char *) dest + first, conn->inbuf, n - first);
+}
+
+/* take the next complete request out of the input buffer, returns 1 if one is available, 0 if not and -1 if invalid */
+static int parserequest(struct connection *conn)
+{
+	struct hbp_header *request = &conn->request;
+	uint32_t used = conn->inhead - conn->intail;
+	size_t hdrlen, off;
+
+	/* the part of the header shared by all versions tells us which version the client uses */
+	if (used < HBP_HEADER_V2_SIZE)
 		return 0;
-	}
+
+	inbuf_copy(conn, request, conn->intail, HBP_HEADER_V2_SIZE);
 
 	/* check if the header is valid and if a compatible HBP version is used by the client */
 	if (request->magic != HBP_MAGIC || request->length > HBP_LENGTH_MAX) {
 		iprintf("%s: not a HBP packet, disconnecting...\n", conn->host);
 		return -1;
 	}
-	if (request->version != HBP_VERSION) {
-		iprintf("%s: HBP version mismatch (client has: %u, server wants %u), disconnecting...\n",
-				conn->host, request->version, HBP_VERSION);
+	if (request->version < HBP_VERSION_MIN || request->version > HBP_VERSION) {
+		iprintf("%s: HBP version mismatch (client has: %u, server wants %u to %u), disconnecting...\n",
+				conn->host, request->version, HBP_VERSION_MIN, HBP_VERSION);
 		return -1;
 	}
 
-	for (int i = 0; reqrepmap[i].index != -1; i++) {
-		if (reqrepmap[i].index != request->type)
-			continue;
+	/* wait for the rest of the header and the request data (if available) */
+	hdrlen = HBP_HEADER_SIZE(request->version);
+	if (used < hdrlen + request->length)
+		return 0;
+
+	/* HBP v2 requests don't have an ID */
+	request->id = 0;
+	inbuf_copy(conn, request, conn->intail, hdrlen);
 
-		dprintf("%s: %s request\n", conn->host, reqrepmap[i].name);
-		break;
+	/* use the request data in place, unless it wraps around the end of the ring buffer */
+	off = (conn->intail + hdrlen) & (CONN_INBUF_SIZE - 1);
+	if (off + request->length <= CONN_INBUF_SIZE) {
+		conn->request_ptr = conn->inbuf + off;
+	} else {
+		inbuf_copy(conn, conn->request_data, conn->intail + hdrlen, request->length);
+		conn->request_ptr = conn->request_data;
 	}
 
-	/* read request data (if available) */
-	if (request->length) {
-		if (!(*buf = malloc(request->length))) {
-			iprintf("out of memory\n");
-			return 0;
-		}
+	/*
+	 * the request is complete, the space it occupies can be reused as soon as it has been handled
+	 * (nothing is received for this connection until then)
+	 */
+	conn->intail += hdrlen + request->length;
+
+	return 1;
+}
+
+size_t session_want(struct connection *conn, char **buf)
+{
+	size_t off = conn->inhead & (CONN_INBUF_SIZE - 1);
+	size_t n = CONN_INBUF_SIZE - (conn->inhead - conn->intail);
+
+	/* only the contiguous free space up to the end of the ring buffer */
+	if (n > CONN_INBUF_SIZE - off)
+		n = CONN_INBUF_SIZE - off;
+
+	*buf = conn->inbuf + off;
+
+	return n;
+}
 
-		if (READ(*buf, request->length) <= 0) {
-			free(*buf);
+int session_received(struct connection *conn, size_t n)
+{
+	conn->inhead += n;
+
+	return parserequest(conn);
+}
+
+void session_sent(struct connection *conn, size_t n)
+{
+	memmove(conn->outbuf, conn->outbuf + n, conn->outlen - n);
+	conn->outlen -= n;
+}
+
+/* receive a request from the client, returns 1 if a complete request is available, 0 if not and -1 on disconnect */
+static int receiverequest(struct connection *conn)
+{
+	ssize_t res;
+	size_t n;
+	char *buf;
+
+	for (;;) {
+		/* requests that have already been received come first */
+		if ((res = parserequest(conn)))
+			return res;
+
+		/* receive as much as is available and fits in the input buffer */
+		if (!(n = session_want(conn, &buf)))
 			return 0;
-		}
+		if ((res = conn_read(conn, buf, n)) <= 0)
+			return res;
+
+		conn->inhead += res;
+	}
+}
+
+static bool batch(struct connection *conn, const struct param *params, struct hbp_header *reply,
+		msgpack_packer *pack);
+
+/* request handlers, indexed by the request type */
+static struct handler handlers[] = {
+	[HBP_REQ_LOGIN] = {
+		.name = "LOGIN",
+		.handle = login,
+		.flags = HANDLER_ANONYMOUS,
+		.schema = login_schema,
+		.nparams = HBP_REQ_LOGIN_LENGTH,
+		.cost = COST_HIGH
+	},
+	[HBP_REQ_LOGOUT] = {
+		.name = "LOGOUT",
+		.handle = logout,
+		.flags = HANDLER_LOCAL | HANDLER_NOOB,
+		.cost = COST_LOW
+	},
+	[HBP_REQ_INFO] = {
+		.name = "INFO",
+		.handle = info,
+		.flags = HANDLER_LOCAL,
+		.cost = COST_DATABASE
+	},
+	[HBP_REQ_BALANCE] = {
+		.name = "BALANCE",
+		.handle = balance,
+		.flags = HANDLER_LOCAL | HANDLER_NOOB,
+		.cost = COST_DATABASE
+	},
+	[HBP_REQ_TRANSFER] = {
+		.name = "TRANSFER",
+		.handle = transfer,
+		.flags = HANDLER_LOCAL | HANDLER_NOOB,
+		.schema = transfer_schema,
+		.nparams = HBP_REQ_TRANSFER_LENGTH,
+		.cost = COST_DATABASE
+	},
+	[HBP_REQ_BATCH] = {
+		.name = "BATCH",
+		.handle = batch,
+		.flags = HANDLER_ANONYMOUS | HANDLER_LOCAL | HANDLER_NOOB,
+		.cost = COST_HIGH
+	},
+	[HBP_REQ_HISTORY] = {
+		.name = "HISTORY",
+		.handle = statement,
+		.flags = HANDLER_LOCAL,
+		.schema = statement_schema,
+		.nparams = HBP_REQ_HISTORY_LENGTH,
+		.cost = COST_DATABASE
+	}
+};
+
+/* look up the name of a request or reply type in reqrepmap (see hbp.h), only used for logging */
+static const char *reqrep_name(uint8_t type)
+{
+	unsigned int i;
+
+	for (i = 0; reqrepmap[i].name; i++) {
+		if (reqrepmap[i].index == type)
+			return reqrepmap[i].name;
+	}
+
+	return "UNKNOWN";
+}
+
+/* check a single request against its descriptor, then handle it and pack the reply */
+static bool dispatch(struct connection *conn, uint8_t type, const char *data, uint16_t len, struct hbp_header *reply,
+		msgpack_packer *pack)
+{
+	struct param params[HANDLER_PARAMS_MAX];
+	struct handler *handler;
+	struct timespec start, end;
+	unsigned int session;
+	bool res = false;
+
+	/* invalid request */
+	if (type >= sizeof(handlers) / sizeof(*handlers) || !handlers[type].handle)
+		return false;
+	handler = &handlers[type];
+
+	dprintf("%s: %s request\n", conn->host, handler->name);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* check if this request is allowed in the current session (if any) */
+	if (!conn->logged_in)
+		session = HANDLER_ANONYMOUS;
+	else
+		session = conn->foreign ? HANDLER_NOOB : HANDLER_LOCAL;
+	if (!(handler->flags & session))
+		goto done;
+
+	/* decode the parameters, unless the handler does that itself */
+	if (handler->schema) {
+		if (!unpack_params(data, len, handler->schema, params, handler->nparams))
+			goto done;
 	} else {
-		*buf = NULL;
+		params[0].type = PARAM_RAW;
+		params[0].via.raw.ptr = data;
+		params[0].via.raw.size = len;
 	}
 
-	return 1;
+	res = handler->handle(conn, params, reply, pack);
+
+done:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	atomic_fetch_add_explicit(&handler->count, 1, memory_order_relaxed);
+	if (!res)
+		atomic_fetch_add_explicit(&handler->errors, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&handler->time, (end.tv_sec - start.tv_sec) * 1000000000ULL +
+			end.tv_nsec - start.tv_nsec, memory_order_relaxed);
+
+	return res;
+}
+
+/* msgpack write callback, appends packed data to the reply */
+static int reply_write(void *data, const char *buf, size_t len)
+{
+	struct reply_buf *reply = data;
+
+	if (reply->overflow || HBP_LENGTH_MAX - reply->size < len) {
+		reply->overflow = true;
+		return -1;
+	}
+
+	memcpy(reply->data + reply->size, buf, len);
+	reply->size += len;
+
+	return 0;
+}
+
+/* write raw bytes to the reply, used for msgpack headers that are filled in afterwards */
+static void reserve(msgpack_packer *pack, const unsigned char *bytes, size_t n)
+{
+	pack->callback(pack->data, (const char *) bytes, n);
+}
+
+/* handle the sub-requests of a #HBP_REQ_BATCH request in order, until one fails */
+static bool batch(struct connection *conn, const struct param *params, struct hbp_header *reply,
+		msgpack_packer *pack)
+{
+	/* array32 header, the number of replies is filled in once all sub-requests have been handled */
+	static const unsigned char array_header[5] = { 0xdd, 0, 0, 0, 0 };
+	/* array of 2 with a uint8 for the reply type, which is filled in once the sub-request has been handled */
+	static const unsigned char reply_header[3] = { 0x92, 0xcc, 0 };
+	/* [ HBP_REP_ERROR, nil ] */
+	static const unsigned char reply_error[4] = { 0x92, 0xcc, HBP_REP_ERROR, 0xc0 };
+
+	struct reply_buf *buf = pack->data;
+	struct unpacker u;
+	struct param type, subparams;
+	struct hbp_header subreply;
+	size_t start, elem;
+	uint32_t i, count, size, n = 0;
+
+	/* decode the request array, the sub-requests are decoded one by one as they are handled */
+	unpack_init(&u, params[0].via.raw.ptr, params[0].via.raw.size);
+	if (!unpack_array(&u, &count) || count > HBP_BATCH_MAX)
+		return false;
+
+	start = buf->size;
+	reserve(pack, array_header, sizeof(array_header));
+
+	for (i = 0; i < count; i++) {
+		/* make sure the reply to this sub-request will still fit */
+		if (HBP_LENGTH_MAX - (buf->size - start) < BATCH_REPLY_MAX + sizeof(reply_error))
+			goto fail;
+
+		/* @param requests: [ type, params ] */
+		if (!unpack_array(&u, &size) || size != 2)
+			goto fail;
+		/* batches can't be nested and a page of history may not fit next to the other replies */
+		if (!unpack_param(&u, PARAM_UINT, &type) || type.via.u64 > UINT8_MAX || type.via.u64 == HBP_REQ_BATCH ||
+				type.via.u64 == HBP_REQ_HISTORY)
+			goto fail;
+
+		/* the request handlers decode the parameters straight from the request data */
+		if (!unpack_param(&u, PARAM_RAW, &subparams))
+			goto fail;
+		if (subparams.type == PARAM_NIL)
+			subparams.via.raw.size = 0;
+
+		/* the handler packs its reply straight into the batch reply */
+		elem = buf->size;
+		reserve(pack, reply_header, sizeof(reply_header));
+
+		if (!dispatch(conn, type.via.u64, subparams.via.raw.ptr, subparams.via.raw.size, &subreply, pack)) {
+			buf->size = elem;
+			goto fail;
+		}
+
+		buf->data[elem + 2] = subreply.type;
+		n++;
+	}
+
+	goto done;
+
+fail:
+	/* stop at the first sub-request that fails */
+	iprintf("%s: error processing batch request %u\n", conn->host, i);
+	conn->errcnt++;
+
+	reserve(pack, reply_error, sizeof(reply_error));
+	n++;
+
+done:
+	/* fill in the number of replies (big-endian) */
+	buf->data[start + 1] = n >> 24;
+	buf->data[start + 2] = n >> 16;
+	buf->data[start + 3] = n >> 8;
+	buf->data[start + 4] = n;
+
+	/* @param type */
+	reply->type = HBP_REP_BATCH;
+
+	return true;
 }
 
 /* handle the specified request and generate an appropriate reply */
 static bool handle_request(struct connection *conn, struct hbp_header *request, const char *request_data,
-		struct hbp_header *reply, char **reply_data)
+		struct hbp_header *reply)
 {
-	msgpack_sbuffer sbuf;
+	struct reply_buf buf;
 	msgpack_packer pack;
 
-	msgpack_sbuffer_init(&sbuf);
-	msgpack_packer_init(&pack, &sbuf, msgpack_sbuffer_write);
+	/*
+	 * pack the reply straight into the output buffer, leaving room for the header in front of it
+	 * (session_writable() guarantees there's room for a reply of #HBP_LENGTH_MAX bytes)
+	 */
+	buf.data = conn->outbuf + conn->outlen + HBP_HEADER_SIZE(reply->version);
+	buf.size = 0;
+	buf.overflow = false;
+	msgpack_packer_init(&pack, &buf, reply_write);
 
 	/* check if the session hasn't timed out */
 	if (conn->logged_in && time(NULL) > conn->expiry_time) {
 		/* log out if the session has timed out */
 		iprintf("%s: Session timeout: %s (User %u, Card %u)\n", conn->host, conn->iban, conn->user_id, conn->card_id);
+		journal_write(conn, JOURNAL_TIMEOUT, request->type, conn->iban, NULL, 0, HBP_TERM_EXPIRED);
+
+		/* the session is over, later requests are handled as if the client never logged in */
+		login_clear(conn);
 
 		/* reply header */
 		reply->type = HBP_REP_TERMINATED;
 
 		/* @param reason */
 		msgpack_pack_int(&pack, HBP_TERM_EXPIRED);
-	} else {
-		/* TODO instead maintain a struct of request handlers and call then appropriately
-		 * (to avoid having to use a switch here)
-		 */
-		switch (request->type) {
-		case HBP_REQ_LOGIN:
-			if (conn->logged_in)
-				goto err;
-
-			if (!login(conn, request_data, request->length, reply, &pack))
-				goto err;
-
-			if (conn->logged_in) {
-				if (!conn->foreign)
-					iprintf("%s: Session login: %s (User %u, Card %u)\n", conn->host, conn->iban,
-							conn->user_id, conn->card_id);
-				else
-					iprintf("%s: Session login: %s (NOOB)\n", conn->host, conn->iban);
-			}
-
-			break;
-		case HBP_REQ_LOGOUT:
-			if (!conn->logged_in)
-				goto err;
-
-			if (!conn->foreign)
-				iprintf("%s: Session logout: %s (User %u, Card %u)\n", conn->host, conn->iban,
-						conn->user_id, conn->card_id);
-			else
-				iprintf("%s: Session logout: %s (NOOB)\n", conn->host, conn->iban);
-
-			conn->logged_in = false;
-			/* clear all other variables for security */
-			conn->expiry_time = 0;
-			memset(conn->iban, 0, HBP_IBAN_MAX + 1);
-			conn->user_id = 0;
-			conn->card_id = 0;
-
-			conn->foreign = false;
-			memset(conn->pin, 0, HBP_PIN_MAX + 1);
-
-			/* also send an appropriate reply to the client that it's been logged out */
-			reply->type = HBP_REP_TERMINATED;
-			/* @param reason */
-			msgpack_pack_int(&pack, HBP_TERM_LOGOUT);
-
-			break;
-		case HBP_REQ_INFO:
-			if (!conn->logged_in || conn->foreign)
-				goto err;
-
-			if (!info(conn, request_data, request->length, reply, &pack))
-				goto err;
-
-			break;
-		case HBP_REQ_BALANCE:
-			if (!conn->logged_in)
-				goto err;
-
-			if (!balance(conn, request_data, request->length, reply, &pack))
-				goto err;
-
-			break;
-		case HBP_REQ_TRANSFER:
-			if (!conn->logged_in)
-				goto err;
-
-			if (!transfer(conn, request_data, request->length, reply, &pack))
-				goto err;
-
-			break;
-		/* invalid request */
-		default:
-			goto err;
-		}
+	} else if (!dispatch(conn, request->type, request_data, request->length, reply, &pack)) {
+		return false;
 	}
 
-	/* copy the msgpack buffer to a newly allocated array to be returned */
-	if (!(*reply_data = realloc(*reply_data, sbuf.size))) {
-		iprintf("out of memory\n");
-		msgpack_sbuffer_destroy(&sbuf);
+	if (buf.overflow) {
+		iprintf("%s: reply exceeds the maximum length\n", conn->host);
 		return false;
 	}
 
-	memcpy(*reply_data, sbuf.data, sbuf.size);
-	reply->length = sbuf.size;
-
-	msgpack_sbuffer_destroy(&sbuf);
+	reply->length = buf.size;
 
 	return true;
+}
 
-err:
-	msgpack_sbuffer_destroy(&sbuf);
-
-	return false;
+bool session_writable(struct connection *conn)
+{
+	return CONN_OUTBUF_SIZE - conn->outlen >= sizeof(struct hbp_header) + HBP_LENGTH_MAX;
 }
 
-void *session(void *args)
+int session_recv(struct connection *conn)
 {
-	struct connection conn;
-	struct hbp_header request, reply;
-	char *request_data, *reply_data;
+	/* don't receive any new requests until there's room for the reply */
+	if (!session_writable(conn))
+		return 0;
 
-	/* set reply header parameters */
-	reply.magic = HBP_MAGIC;
-	reply.version = HBP_VERSION;
+	return receiverequest(conn);
+}
 
-	/* allocate initial buffers for reply and request data */
-	request_data = malloc(128);
-	reply_data = malloc(128);
-	/* TODO check for enomem */
+bool session_reject(struct connection *conn)
+{
+	struct hbp_header reply;
 
-	/* setup our connection structure */
-	memset(&conn, 0, sizeof(struct connection));
-	conn.socket = *((int *) args);
+	iprintf("%s: all workers are busy, rejecting request\n", conn->host);
 
-	/* verify the client certificate */
-	if (!verify(&conn))
-		goto ret;
+	/* reply using the same version of HBP as the request */
+	reply.magic = HBP_MAGIC;
+	reply.version = conn->request.version;
+	reply.id = conn->request.id;
+	reply.type = HBP_REP_ERROR;
+	reply.length = 0;
 
-	/* connect to the database */
-	if (!(conn.sql = mysql_init(NULL))) {
-		iprintf("out of memory\n");
-		goto ret;
-	}
-	if (!mysql_real_connect(conn.sql, sql_host, sql_user, sql_pass, sql_db, sql_port, NULL, 0)) {
-		iprintf("failed to connect to the database: %s\n", mysql_error(conn.sql));
-		goto ret;
-	}
+	return sendreply(conn, &reply);
+}
 
-	for (;;) {
-		/* disconnect if the maximum number of erroneous requests has been exceeded */
-		if (conn.errcnt > HBP_ERROR_MAX) {
-			iprintf("%s: the maximum error count (%d) has been exceeded\n", conn.host, HBP_ERROR_MAX);
+int session_process(struct connection *conn, struct worker *worker)
+{
+	struct hbp_header reply;
+	int res;
 
-			break;
-		}
+	reply.magic = HBP_MAGIC;
 
-		/* listen for requests from the client */
-		switch (receiverequest(&conn, &request, &request_data)) {
-		case 1:
-			/* success */
-			break;
-		case 0:
-			/* invalid request */
-			iprintf("%s: invalid request\n", conn.host);
-			conn.errcnt++;
-			continue;
-		case -1:
-			/* disconnect */
-			goto ret;
-		}
+	do {
+		/* reply using the same version of HBP as the request, with the same ID */
+		reply.version = conn->request.version;
+		reply.id = conn->request.id;
 
 		/* process the client's request */
-		if (!handle_request(&conn, &request, request_data, &reply, &reply_data)) {
-			iprintf("%s: error processing request\n", conn.host);
-			conn.errcnt++;
+		if (!handle_request(conn, &conn->request, conn->request_ptr, &reply)) {
+			iprintf("%s: error processing request\n", conn->host);
+			conn->errcnt++;
 
 			/* don't continue, but inform the client that processing their request has failed */
 			reply.type = HBP_REP_ERROR;
@@ -343,42 +675,63 @@ void *session(void *args)
 		}
 
 		/* send our reply */
-		if (!sendreply(&conn, &reply, reply_data)) {
-			iprintf("%s: error sending reply\n", conn.host);
-			conn.errcnt++;
-			continue;
+		if (!sendreply(conn, &reply)) {
+			iprintf("%s: error sending reply\n", conn->host);
+			return -1;
 		}
 
-		for (int i = 0; reqrepmap[i].index != -1; i++) {
-			if (reqrepmap[i].index != reply.type)
-				continue;
+		dprintf("%s: %s reply\n", conn->host, reqrep_name(reply.type));
 
-			dprintf("%s: %s reply\n", conn.host, reqrepmap[i].name);
-			break;
+		/* disconnect if the maximum number of erroneous requests has been exceeded */
+		if (conn->errcnt > HBP_ERROR_MAX) {
+			iprintf("%s: the maximum error count (%d) has been exceeded\n", conn->host, HBP_ERROR_MAX);
+			return -1;
 		}
-	}
 
-ret:
-	dprintf("%s: Client disconnected\n", conn.host);
+		/* keep going for as long as the client has more requests for us */
+	} while ((res = session_recv(conn)) > 0);
+
+	return res;
+}
+
+void session_stats(void)
+{
+	static const char *const costs[] = { "low", "database", "high" };
+	unsigned long count;
+	unsigned int i;
 
-	/* free the reply and request data buffers */
-	free(request_data);
-	free(reply_data);
+	for (i = 0; i < sizeof(handlers) / sizeof(*handlers); i++) {
+		if (!handlers[i].handle)
+			continue;
 
-	/* close the database connection */
-	if (conn.sql) {
-		mysql_close(conn.sql);
-		mysql_thread_end();
+		count = atomic_load_explicit(&handlers[i].count, memory_order_relaxed);
+		iprintf("%s (%s cost): %lu handled, %lu failed, %.3f ms on average\n", handlers[i].name,
+				costs[handlers[i].cost], count,
+				atomic_load_explicit(&handlers[i].errors, memory_order_relaxed),
+				count ? atomic_load_explicit(&handlers[i].time, memory_order_relaxed) / 1e6 / count : 0);
 	}
+}
+
+void session_close(struct connection *conn)
+{
+	dprintf("%s: Client disconnected\n", conn->host);
 
 	/* close the client connection */
 #if SSLSOCK
-	if (conn.ssl) {
-		/* SSL_shutdown(conn.ssl); */
-		SSL_free(conn.ssl);
+	if (conn->ssl) {
+		/* SSL_shutdown(conn->ssl); */
+
+		/* put the SSL structure back in the cache if there's still room */
+		pthread_mutex_lock(&ssl_cache_lock);
+		if (ssl_cached < SSL_CACHE_MAX && SSL_clear(conn->ssl) == 1) {
+			ssl_cache[ssl_cached++] = conn->ssl;
+			conn->ssl = NULL;
+		}
+		pthread_mutex_unlock(&ssl_cache_lock);
+
+		if (conn->ssl)
+			SSL_free(conn->ssl);
 	}
 #endif
-	close(conn.socket);
-
-	pthread_exit(NULL);
+	close(conn->socket);
 }
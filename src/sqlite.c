@@ -0,0 +1,586 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+/* there are no replicas, every connection opens the same database file */
+static struct db_pool primary;
+
+/* statements prepared on every pooled connection, indexed by stmt_t */
+static const char *statements[STMT_COUNT] = {
+	[STMT_CARD]		= "SELECT `user_id`, `card_id`, `pin`, `attempts`, `iban` FROM `cards` "
+				  "WHERE `iban_key` = ?1 AND (`iban` = ?2 OR `iban` LIKE ?2 || '__') LIMIT 1",
+	[STMT_CARD_SHORT]	= "SELECT `user_id`, `card_id`, `pin`, `attempts`, `iban` FROM `cards` "
+				  "WHERE `iban` = ?1 OR `iban` LIKE ?1 || '__' LIMIT 1",
+	[STMT_ATTEMPTS_RESET]	= "UPDATE `cards` SET `attempts` = 0 WHERE `iban` = ?1",
+	[STMT_ATTEMPTS_INC]	= "UPDATE `cards` SET `attempts` = `attempts` + 1 WHERE `iban` = ?1",
+	[STMT_BALANCE]		= "SELECT `balance` FROM `accounts` WHERE `iban` = ?1",
+	[STMT_DEBIT]		= "UPDATE `accounts` SET `balance` = `balance` - ?2 WHERE `iban` = ?1 AND `balance` >= ?2",
+	[STMT_CREDIT]		= "UPDATE `accounts` SET `balance` = `balance` + ?2 WHERE `iban` = ?1",
+	[STMT_USER]		= "SELECT `first_name`, `last_name` FROM `users` WHERE `user_id` = ?1",
+	/* same as the MariaDB query, both halves are a range scan on their own index */
+	[STMT_HISTORY]		= "SELECT `transaction_id`, `time`, `status`, IFNULL(`source_iban`, ''), "
+				  "IFNULL(`dest_iban`, ''), `amount` FROM ("
+				  "SELECT * FROM (SELECT * FROM `transactions` WHERE `source_iban` = ?1 AND "
+				  "`transaction_id` < ?2 ORDER BY `transaction_id` DESC LIMIT ?3) UNION "
+				  "SELECT * FROM (SELECT * FROM `transactions` WHERE `dest_iban` = ?1 AND "
+				  "`transaction_id` < ?2 ORDER BY `transaction_id` DESC LIMIT ?3)"
+				  ") ORDER BY `transaction_id` DESC LIMIT ?3",
+	[STMT_HISTORY_INSERT]	= "INSERT INTO `transactions` (`status`, `time`, `source_iban`, `dest_iban`, `amount`) "
+				  "VALUES (?1, ?2, ?3, NULLIF(?4, ''), ?5)",
+	/* only one connection can write at a time, take the lock up front so a transaction never has to give up */
+	[STMT_BEGIN]		= "BEGIN IMMEDIATE",
+	[STMT_COMMIT]		= "COMMIT",
+	[STMT_ROLLBACK]		= "ROLLBACK",
+	[STMT_SAVEPOINT]	= "SAVEPOINT `transfer`",
+	[STMT_RELEASE]		= "RELEASE `transfer`",
+	[STMT_ROLLBACK_TO]	= "ROLLBACK TO `transfer`"
+};
+
+static unsigned long long elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+static void db_close(struct db_conn *db)
+{
+	stmt_t i;
+
+	for (i = 0; i < STMT_COUNT; i++) {
+		if (db->stmt[i])
+			sqlite3_finalize(db->stmt[i]);
+		db->stmt[i] = NULL;
+	}
+
+	if (db->sql)
+		sqlite3_close(db->sql);
+	db->sql = NULL;
+}
+
+/* open the database and prepare all statements */
+static bool db_connect(struct db_conn *db)
+{
+	char *err;
+	stmt_t i;
+
+	/* every connection is only used by one thread at a time */
+	if (sqlite3_open_v2(db->pool->host, &db->sql, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+		iprintf("failed to open the database %s: %s\n", db->pool->host,
+				db->sql ? sqlite3_errmsg(db->sql) : "out of memory");
+		goto err;
+	}
+
+	/* readers don't block the writer (and vice versa) with a write-ahead log */
+	if (sqlite3_exec(db->sql, "PRAGMA journal_mode = WAL", NULL, NULL, &err) != SQLITE_OK) {
+		iprintf("failed to enable the write-ahead log: %s\n", err);
+		sqlite3_free(err);
+		goto err;
+	}
+
+	sqlite3_busy_timeout(db->sql, DB_SQLITE_BUSY_TIMEOUT);
+
+	for (i = 0; i < STMT_COUNT; i++) {
+		if (sqlite3_prepare_v3(db->sql, statements[i], -1, SQLITE_PREPARE_PERSISTENT, &db->stmt[i], NULL) !=
+				SQLITE_OK) {
+			iprintf("failed to prepare statement: %s\n", sqlite3_errmsg(db->sql));
+			goto err;
+		}
+	}
+
+	db->checked = time(NULL);
+
+	return true;
+
+err:
+	db_close(db);
+	return false;
+}
+
+bool db_start(unsigned int size)
+{
+	unsigned int i;
+
+	iprintf(" Opening the database %s (%u connections)...\n", sql_db, size);
+
+	primary.host = sql_db;
+	pthread_mutex_init(&primary.lock, NULL);
+
+	if (!(primary.conns = calloc(size, sizeof(struct db_conn)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+	primary.size = size;
+
+	for (i = 0; i < size; i++) {
+		primary.conns[i].pool = &primary;
+
+		if (!db_connect(&primary.conns[i]))
+			return false;
+
+		primary.conns[i].next = primary.idle;
+		primary.idle = &primary.conns[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &primary.stat_start);
+
+	return true;
+}
+
+void db_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < primary.size; i++)
+		db_close(&primary.conns[i]);
+
+	free(primary.conns);
+	primary.conns = primary.idle = NULL;
+	primary.size = 0;
+}
+
+struct db_conn *db_acquire(bool replica)
+{
+	struct db_conn *db;
+	struct db_waiter waiter;
+	struct timespec start, end;
+	unsigned long long wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&primary.lock);
+	if (primary.idle) {
+		db = primary.idle;
+		primary.idle = db->next;
+		if (++primary.busy > primary.peak)
+			primary.peak = primary.busy;
+	} else {
+		/* park until a connection is handed over, the same as the MariaDB pool */
+		primary.stat_waited++;
+		worker_prepare(&waiter.waiter);
+		waiter.db = NULL;
+		waiter.next = NULL;
+		if (primary.waiting_tail)
+			primary.waiting_tail->next = &waiter;
+		else
+			primary.waiting = &waiter;
+		primary.waiting_tail = &waiter;
+		pthread_mutex_unlock(&primary.lock);
+
+		worker_sleep(&waiter.waiter);
+
+		pthread_mutex_lock(&primary.lock);
+		db = waiter.db;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wait = elapsed(&start, &end);
+	primary.stat_acquired++;
+	primary.stat_wait += wait;
+	if (wait > primary.stat_wait_max)
+		primary.stat_wait_max = wait;
+	pthread_mutex_unlock(&primary.lock);
+
+	db->acquired = end;
+
+	return db;
+}
+
+void db_release(struct db_conn *db)
+{
+	struct db_waiter *waiter;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&primary.lock);
+	primary.stat_busy += elapsed(&db->acquired, &now);
+
+	/* hand the connection straight to the oldest waiting request, it stays busy */
+	if ((waiter = primary.waiting)) {
+		if (!(primary.waiting = waiter->next))
+			primary.waiting_tail = NULL;
+		waiter->db = db;
+		pthread_mutex_unlock(&primary.lock);
+
+		/* the waiter may be gone once it's woken up */
+		worker_wake(&waiter->waiter);
+		return;
+	}
+
+	db->next = primary.idle;
+	primary.idle = db;
+	primary.busy--;
+	pthread_mutex_unlock(&primary.lock);
+}
+
+void db_stats(void)
+{
+	struct timespec now;
+	unsigned long long total;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	total = elapsed(&primary.stat_start, &now) * primary.size;
+
+	pthread_mutex_lock(&primary.lock);
+	iprintf("Database %s: %u/%u connections in use (peak %u), utilization %.1f%%, acquired: %lu, waited: %lu "
+			"(average %.3f ms, max %.3f ms)\n", primary.host, primary.busy, primary.size, primary.peak,
+			total ? 100.0 * primary.stat_busy / total : 0, primary.stat_acquired, primary.stat_waited,
+			primary.stat_acquired ? primary.stat_wait / 1e6 / primary.stat_acquired : 0,
+			primary.stat_wait_max / 1e6);
+	pthread_mutex_unlock(&primary.lock);
+}
+
+/* run a statement up to its next row, returns 1 if there is one, 0 if it's done and -1 on error */
+static int db_step(struct db_conn *db, stmt_t type)
+{
+	switch (sqlite3_step(db->stmt[type])) {
+	case SQLITE_ROW:
+		return 1;
+	case SQLITE_DONE:
+		return 0;
+	default:
+		iprintf("error executing statement: %s\n", sqlite3_errmsg(db->sql));
+		return -1;
+	}
+}
+
+/* make a statement ready to be executed again */
+static void db_reset(struct db_conn *db, stmt_t type)
+{
+	sqlite3_reset(db->stmt[type]);
+	sqlite3_clear_bindings(db->stmt[type]);
+}
+
+/* run a statement without results, returns the number of changed rows or -1 on error */
+static int db_run(struct db_conn *db, stmt_t type)
+{
+	int res;
+
+	if ((res = db_step(db, type)) >= 0)
+		res = sqlite3_changes(db->sql);
+	db_reset(db, type);
+
+	return res;
+}
+
+/* copy a text column, returns false if it doesn't fit */
+static bool db_text(struct db_conn *db, stmt_t type, int col, char *buf, size_t size)
+{
+	const unsigned char *text = sqlite3_column_text(db->stmt[type], col);
+	int len = sqlite3_column_bytes(db->stmt[type], col);
+
+	if (len < 0 || (size_t) len >= size)
+		return false;
+
+	memcpy(buf, text ? (const char *) text : "", len);
+	buf[len] = '\0';
+
+	return true;
+}
+
+int db_card(const char *iban, struct db_card *card)
+{
+	struct db_conn *db;
+	stmt_t type;
+	char id[13];
+	int res;
+
+	if (!(db = db_acquire(false)))
+		return -1;
+
+	/*
+	 * a full IBAN and the same IBAN without its last 2 characters have the same indexed lookup key, the rest of the
+	 * match is checked per row. The key isn't known if the IBAN that's looked up is shorter than the key itself.
+	 */
+	if (strlen(iban) >= DB_IBAN_KEY_LEN) {
+		type = STMT_CARD;
+		sqlite3_bind_text(db->stmt[type], 1, iban, DB_IBAN_KEY_LEN, SQLITE_STATIC);
+		sqlite3_bind_text(db->stmt[type], 2, iban, -1, SQLITE_STATIC);
+	} else {
+		type = STMT_CARD_SHORT;
+		sqlite3_bind_text(db->stmt[type], 1, iban, -1, SQLITE_STATIC);
+	}
+
+	if ((res = db_step(db, type)) > 0) {
+		if (!db_text(db, type, 1, id, sizeof(id)) || !db_text(db, type, 2, card->pin, DB_PIN_MAX + 1) ||
+				!db_text(db, type, 4, card->iban, HBP_IBAN_MAX + 1)) {
+			iprintf("card %s has malformed data\n", iban);
+			res = -1;
+		} else {
+			card->user_id = sqlite3_column_int64(db->stmt[type], 0);
+			card->card_id = strtol(id, NULL, 10);
+			card->attempts = sqlite3_column_int(db->stmt[type], 3);
+		}
+	}
+
+	db_reset(db, type);
+	db_release(db);
+
+	return res;
+}
+
+bool db_attempts(const char *iban, bool reset)
+{
+	struct db_conn *db;
+	stmt_t type = reset ? STMT_ATTEMPTS_RESET : STMT_ATTEMPTS_INC;
+	int res;
+
+	if (!(db = db_acquire(false)))
+		return false;
+
+	sqlite3_bind_text(db->stmt[type], 1, iban, -1, SQLITE_STATIC);
+	res = db_run(db, type);
+
+	db_release(db);
+
+	return res >= 0;
+}
+
+int db_balance(const char *iban, int64_t *balance, bool replica)
+{
+	struct db_conn *db;
+	int res;
+
+	if (!(db = db_acquire(replica)))
+		return -1;
+
+	sqlite3_bind_text(db->stmt[STMT_BALANCE], 1, iban, -1, SQLITE_STATIC);
+	if ((res = db_step(db, STMT_BALANCE)) > 0)
+		*balance = sqlite3_column_int64(db->stmt[STMT_BALANCE], 0);
+
+	db_reset(db, STMT_BALANCE);
+	db_release(db);
+
+	return res;
+}
+
+/* transfer an amount as part of the current transaction, the same as the `transfer_apply` procedure of db.sql */
+static int transfer_apply(struct db_conn *db, const char *source, const char *dest, int64_t amount)
+{
+	int res;
+
+	if (db_run(db, STMT_SAVEPOINT) < 0)
+		return -1;
+
+	sqlite3_bind_text(db->stmt[STMT_DEBIT], 1, source, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(db->stmt[STMT_DEBIT], 2, amount);
+	if ((res = db_run(db, STMT_DEBIT)) <= 0)
+		goto done;
+
+	if (dest[0]) {
+		sqlite3_bind_text(db->stmt[STMT_CREDIT], 1, dest, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(db->stmt[STMT_CREDIT], 2, amount);
+		if ((res = db_run(db, STMT_CREDIT)) == 0) {
+			iprintf("unknown destination account: %s\n", dest);
+			res = -1;
+		}
+	}
+
+	/* recorded as part of the transfer, so the history never misses one */
+	if (res > 0) {
+		sqlite3_bind_int(db->stmt[STMT_HISTORY_INSERT], 1, HBP_TRANSFER_SUCCESS);
+		sqlite3_bind_int64(db->stmt[STMT_HISTORY_INSERT], 2, time(NULL));
+		sqlite3_bind_text(db->stmt[STMT_HISTORY_INSERT], 3, source, -1, SQLITE_STATIC);
+		sqlite3_bind_text(db->stmt[STMT_HISTORY_INSERT], 4, dest, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(db->stmt[STMT_HISTORY_INSERT], 5, amount);
+		if (db_run(db, STMT_HISTORY_INSERT) < 0)
+			res = -1;
+	}
+
+done:
+	/* a transfer that fails is rolled back on its own */
+	if (res < 0)
+		db_run(db, STMT_ROLLBACK_TO);
+	db_run(db, STMT_RELEASE);
+
+	return res < 0 ? -1 : res > 0;
+}
+
+int db_transfer(const char *source, const char *dest, int64_t amount)
+{
+	struct db_conn *db;
+	int res = -1;
+
+	if (!(db = db_acquire(false)))
+		return -1;
+
+	if (db_run(db, STMT_BEGIN) < 0)
+		goto err;
+
+	if ((res = transfer_apply(db, source, dest, amount)) < 0 || db_run(db, STMT_COMMIT) < 0) {
+		db_run(db, STMT_ROLLBACK);
+		res = -1;
+	}
+
+err:
+	db_release(db);
+
+	return res;
+}
+
+bool db_transfers(struct db_transfer **transfers, unsigned int count)
+{
+	struct db_conn *db;
+	unsigned int i;
+
+	if (!(db = db_acquire(false)))
+		goto err;
+
+	if (db_run(db, STMT_BEGIN) < 0)
+		goto err_release;
+
+	for (i = 0; i < count; i++) {
+		transfers[i]->result = transfer_apply(db, transfers[i]->source, transfers[i]->dest, transfers[i]->amount);
+
+		/* some errors (such as a full disk) roll back the whole transaction */
+		if (transfers[i]->result < 0 && sqlite3_get_autocommit(db->sql))
+			goto err_release;
+	}
+
+	if (db_run(db, STMT_COMMIT) < 0)
+		goto err_rollback;
+
+	db_release(db);
+
+	return true;
+
+err_rollback:
+	db_run(db, STMT_ROLLBACK);
+err_release:
+	db_release(db);
+err:
+	for (i = 0; i < count; i++)
+		transfers[i]->result = -1;
+
+	return false;
+}
+
+bool db_history(const struct history_record *records, unsigned int count)
+{
+	struct db_conn *db;
+	sqlite3_stmt *stmt;
+	unsigned int i;
+
+	if (!(db = db_acquire(false)))
+		return false;
+	stmt = db->stmt[STMT_HISTORY_INSERT];
+
+	/* there's no round trip per row, the transaction makes sure the batch is only synced to disk once */
+	if (db_run(db, STMT_BEGIN) < 0)
+		goto err;
+
+	for (i = 0; i < count; i++) {
+		sqlite3_bind_int(stmt, 1, records[i].status);
+		sqlite3_bind_int64(stmt, 2, records[i].time);
+		sqlite3_bind_text(stmt, 3, records[i].source, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, records[i].dest, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 5, records[i].amount);
+
+		if (db_run(db, STMT_HISTORY_INSERT) < 0)
+			goto err_rollback;
+	}
+
+	if (db_run(db, STMT_COMMIT) < 0)
+		goto err_rollback;
+
+	db_release(db);
+
+	return true;
+
+err_rollback:
+	db_run(db, STMT_ROLLBACK);
+err:
+	db_release(db);
+
+	return false;
+}
+
+int db_user(uint32_t user_id, char *first_name, char *last_name, bool replica)
+{
+	struct db_conn *db;
+	const char *first, *last;
+	int res;
+
+	if (!(db = db_acquire(replica)))
+		return -1;
+
+	sqlite3_bind_int64(db->stmt[STMT_USER], 1, user_id);
+	if ((res = db_step(db, STMT_USER)) > 0) {
+		/* names are truncated rather than rejected, NULL (or out of memory) is an empty name */
+		first = (const char *) sqlite3_column_text(db->stmt[STMT_USER], 0);
+		last = (const char *) sqlite3_column_text(db->stmt[STMT_USER], 1);
+		snprintf(first_name, DB_NAME_MAX + 1, "%s", first ? first : "");
+		snprintf(last_name, DB_NAME_MAX + 1, "%s", last ? last : "");
+	}
+
+	db_reset(db, STMT_USER);
+	db_release(db);
+
+	return res;
+}
+
+int db_transactions(const char *iban, uint64_t cursor, struct db_transaction *transactions, unsigned int max,
+		bool replica)
+{
+	struct db_conn *db;
+	sqlite3_stmt *stmt;
+	unsigned int n = 0;
+	int res = 0;
+
+	if (!(db = db_acquire(replica)))
+		return -1;
+	stmt = db->stmt[STMT_HISTORY];
+
+	/* a cursor of 0 starts at the most recent transaction, SQLite integers are signed */
+	sqlite3_bind_text(stmt, 1, iban, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, !cursor || cursor > INT64_MAX ? INT64_MAX : (int64_t) cursor);
+	sqlite3_bind_int64(stmt, 3, max);
+
+	while (n < max && (res = db_step(db, STMT_HISTORY)) > 0) {
+		/* the columns are at most as long as an IBAN */
+		if (!db_text(db, STMT_HISTORY, 3, transactions[n].source, HBP_IBAN_MAX + 1) ||
+				!db_text(db, STMT_HISTORY, 4, transactions[n].dest, HBP_IBAN_MAX + 1))
+			continue;
+
+		transactions[n].id = sqlite3_column_int64(stmt, 0);
+		transactions[n].time = sqlite3_column_int64(stmt, 1);
+		transactions[n].status = sqlite3_column_int(stmt, 2);
+		transactions[n].amount = sqlite3_column_int64(stmt, 5);
+		n++;
+	}
+
+	db_reset(db, STMT_HISTORY);
+	db_release(db);
+
+	return res < 0 ? -1 : (int) n;
+}
@@ -0,0 +1,92 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+/* upper bound of the size of a single transaction in a #HBP_REP_HISTORY reply */
+#define TRANSACTION_MAX	(1 + 9 + 9 + 2 + HBP_IBAN_MAX + 9 + 2)
+/* upper bound of the size of a #HBP_REP_HISTORY reply without the transactions */
+#define STATEMENT_MAX	(1 + 3 + 9)
+
+_Static_assert(STATEMENT_MAX + HBP_HISTORY_MAX * TRANSACTION_MAX <= HBP_LENGTH_MAX,
+		"a full page of transactions doesn't fit in a reply");
+
+const param_type_t statement_schema[HBP_REQ_HISTORY_LENGTH] = {
+	[HBP_REQ_HISTORY_CURSOR]	= PARAM_UINT
+};
+
+bool statement(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack)
+{
+	/* one more than fits in the reply, to find out whether there's a next page */
+	struct db_transaction transactions[HBP_HISTORY_MAX + 1];
+	const char *iban;
+	uint64_t cursor;
+	int64_t amount;
+	int i, n;
+
+	/* @param cursor */
+	cursor = params[HBP_REQ_HISTORY_CURSOR].via.u64;
+
+	/* the history is recorded in the background anyway, so a replica will do */
+	if ((n = db_transactions(conn->iban, cursor, transactions, HBP_HISTORY_MAX + 1,
+					time(NULL) >= conn->primary_until)) < 0)
+		return false;
+
+	/* @param type */
+	reply->type = HBP_REP_HISTORY;
+
+	msgpack_pack_array(pack, HBP_REP_HISTORY_LENGTH);
+
+	/* @param transactions */
+	msgpack_pack_array(pack, n > HBP_HISTORY_MAX ? HBP_HISTORY_MAX : n);
+	for (i = 0; i < n && i < HBP_HISTORY_MAX; i++) {
+		/* show the other account, deposits have this account on both sides */
+		if (!strcmp(transactions[i].source, conn->iban) && strcmp(transactions[i].dest, conn->iban)) {
+			iban = transactions[i].dest;
+			amount = -transactions[i].amount;
+		} else {
+			iban = transactions[i].source;
+			amount = transactions[i].amount;
+		}
+
+		msgpack_pack_array(pack, HBP_REP_HISTORY_TRANSACTION_LENGTH);
+		msgpack_pack_uint64(pack, transactions[i].id);
+		msgpack_pack_int64(pack, transactions[i].time);
+		msgpack_pack_str(pack, strlen(iban));
+		msgpack_pack_str_body(pack, iban, strlen(iban));
+		msgpack_pack_int64(pack, amount);
+		msgpack_pack_int(pack, transactions[i].status);
+	}
+
+	/* @param cursor */
+	msgpack_pack_uint64(pack, n > HBP_HISTORY_MAX ? transactions[HBP_HISTORY_MAX - 1].id : 0);
+
+	return true;
+}
@@ -29,78 +29,52 @@
 #include "hbp.h"
 #include "herbank.h"
 
-static bool local_transfer(struct connection *conn, msgpack_packer *pack, const char *iban, int64_t amount)
+/* returns the result of the transfer (see #hbp_rep_transfer_result_t) or -1 on error */
+static int local_transfer(struct connection *conn, const char *iban, int64_t amount)
 {
-	MYSQL_RES *sqlres = NULL;
-	MYSQL_ROW row;
+	int64_t balance;
+	int res;
 
-	/*
-	 * check if the account entry can be found by its IBAN in the database
-	 *
-	 * We shouldn't have to check the IBAN; this is already done when a new session is created.
-	 * Extra checks never hurt though.
-	 */
-	sqlres = query(conn, "SELECT `balance` FROM `accounts` WHERE `iban` = '%s'", conn->iban);
-	if (!(row = mysql_fetch_row(sqlres))) {
-		dprintf("invalid IBAN: %s\n", conn->iban);
-		goto err;
+	if (strcmp(conn->iban, iban) == 0) {
+		/* deposit: Not Yet Implemented */
+
+		iprintf("NYI: deposit\n");
+		return -1;
 	}
-	mysql_free_result(sqlres);
 
 	/*
-	 * check if the funds of the current account are sufficient
+	 * subtract from the balance on our account and add to the balance on the other account (if this isn't a
+	 * withdrawal) in a single transaction, this only succeeds if the funds are sufficient
+	 * The transaction may be shared with the transfers of other sessions, we're parked until it has been committed.
 	 *
 	 * TODO? allow accounts to go below 0
 	 */
-	sqlres = query(conn, "SELECT `balance` FROM `accounts` WHERE `iban` = '%s' AND `balance` >= '%lld'",
-			conn->iban, amount);
-	if (!(row = mysql_fetch_row(sqlres))) {
-		/* @param status */
-		msgpack_pack_int(pack, HBP_TRANSFER_INSUFFICIENT_FUNDS);
-	} else {
-		if (strlen(iban) == 0) {
-			/* withdrawal */
-
-			mysql_free_result(sqlres);
-			sqlres = query(conn, "UPDATE `accounts` SET `balance` = `balance` - '%lld' WHERE `iban` = '%s'",
-					amount, conn->iban);
-
-			/* @param result */
-			msgpack_pack_int(pack, HBP_TRANSFER_SUCCESS);
-		} else if (strcmp(conn->iban, iban) == 0) {
-			/* deposit: Not Yet Implemented */
-
-			iprintf("NYI: deposit\n");
-			goto err;
-		} else {
-			/* transfer */
-
-			/* subtract from the balance on our account */
-			mysql_free_result(sqlres);
-			sqlres = query(conn, "UPDATE `accounts` SET `balance` = `balance` - '%lld' WHERE `iban` = '%s'",
-					amount, conn->iban);
-
-			/* add to balance on the other account */
-			mysql_free_result(sqlres);
-			sqlres = query(conn, "UPDATE `accounts` SET `balance` = `balance` + '%lld' WHERE `iban` = '%s'",
-					amount, iban);
-
-			/* @param result */
-			msgpack_pack_int(pack, HBP_TRANSFER_SUCCESS);
+	if ((res = commit_transfer(conn->iban, iban, amount)) < 0)
+		return -1;
+
+	if (res == 0) {
+		/*
+		 * check if the account entry can be found by its IBAN in the database
+		 *
+		 * We shouldn't have to check the IBAN; this is already done when a new session is created.
+		 * Extra checks never hurt though.
+		 */
+		if (db_balance(conn->iban, &balance, false) <= 0) {
+			dprintf("invalid IBAN: %s\n", conn->iban);
+			return -1;
 		}
-	}
-
-	mysql_free_result(sqlres);
 
-	return true;
+		return HBP_TRANSFER_INSUFFICIENT_FUNDS;
+	}
 
-err:
-	mysql_free_result(sqlres);
+	/* replicas might not have this transfer yet, read from the primary for a while so the session sees it */
+	conn->primary_until = time(NULL) + DB_STICKY_INTERVAL;
 
-	return false;
+	return HBP_TRANSFER_SUCCESS;
 }
 
-static bool noob_transfer(struct connection *conn, msgpack_packer *pack, const char *iban, int64_t amount)
+/* returns the result of the transfer (see #hbp_rep_transfer_result_t) or -1 on error */
+static int noob_transfer(struct connection *conn, const char *iban, int64_t amount)
 {
 	char inbuf[BUF_SIZE + 1];
 	char outbuf[BUF_SIZE + 1];
@@ -108,7 +82,7 @@ static bool noob_transfer(struct connection *conn, msgpack_packer *pack, const c
 
 	/* NOOB only supports withdrawals, so we need an empty iban */
 	if (strlen(iban) != 0)
-		return false;
+		return -1;
 
 	snprintf(inbuf, BUF_SIZE + 1, ", \"amount\": %lld", amount);
 
@@ -119,77 +93,62 @@ static bool noob_transfer(struct connection *conn, msgpack_packer *pack, const c
 	status = noob_request(outbuf, "withdraw", conn->iban, conn->pin, inbuf);
 
 	if (status == 437 && strcmp(outbuf, "Balance too low") == 0)
-		msgpack_pack_int(pack, HBP_TRANSFER_INSUFFICIENT_FUNDS);
+		return HBP_TRANSFER_INSUFFICIENT_FUNDS;
 	else if (status == 208)
-		msgpack_pack_int(pack, HBP_TRANSFER_SUCCESS);
+		return HBP_TRANSFER_SUCCESS;
 	else
-		return false;
-
-	return true;
+		return -1;
 }
 
-bool transfer(struct connection *conn, const char *data, uint16_t len, struct hbp_header *reply, msgpack_packer *pack)
+const param_type_t transfer_schema[HBP_REQ_TRANSFER_LENGTH] = {
+	[HBP_REQ_TRANSFER_IBAN]		= PARAM_STR,
+	[HBP_REQ_TRANSFER_AMOUNT]	= PARAM_INT
+};
+
+bool transfer(struct connection *conn, const struct param *params, struct hbp_header *reply, msgpack_packer *pack)
 {
-	char iban[HBP_IBAN_MAX + 1], *escaped;
+	char iban[HBP_IBAN_MAX + 1];
 	int64_t amount;
-	msgpack_unpacker unpack;
-	msgpack_unpacked unpacked;
-	msgpack_object *array;
-	bool res = false;
-
-	if (!msgpack_unpacker_init(&unpack, len))
-		return false;
-
-	/* adjust the buffer size if needed */
-	if (msgpack_unpacker_buffer_capacity(&unpack) < len) {
-		if (!msgpack_unpacker_reserve_buffer(&unpack, len)) {
-			msgpack_unpacker_destroy(&unpack);
-			return false;
-		}
-	}
-
-	/* copy request data into the msgpack buffer */
-	memcpy(msgpack_unpacker_buffer(&unpack), data, len);
-	msgpack_unpacker_buffer_consumed(&unpack, len);
-
-	/* unpack the request array */
-	msgpack_unpacked_init(&unpacked);
-	if (msgpack_unpacker_next(&unpack, &unpacked) != MSGPACK_UNPACK_SUCCESS)
-		goto err;
-	if (unpacked.data.type != MSGPACK_OBJECT_ARRAY || unpacked.data.via.array.size != HBP_REQ_TRANSFER_LENGTH)
-		goto err;
-	array = unpacked.data.via.array.ptr;
+	int result;
 
 	/* @param iban */
-	if (array[HBP_REQ_TRANSFER_IBAN].via.str.size && (array[HBP_REQ_TRANSFER_IBAN].via.str.size < HBP_IBAN_MIN ||
-				array[HBP_REQ_TRANSFER_IBAN].via.str.size > HBP_IBAN_MAX))
-		goto err;
-	memcpy(iban, array[HBP_REQ_TRANSFER_IBAN].via.str.ptr, array[HBP_REQ_TRANSFER_IBAN].via.str.size);
-	iban[array[HBP_REQ_TRANSFER_IBAN].via.str.size] = '\0';
-
-	/* escape the IBAN */
-	if ((escaped = escape(conn, iban, HBP_IBAN_MAX))) {
-		strcpy(iban, escaped);
-		free(escaped);
-	} else {
-		dprintf("invalid IBAN: %s\n", iban);
-		goto err;
-	}
+	if (params[HBP_REQ_TRANSFER_IBAN].via.str.size && (params[HBP_REQ_TRANSFER_IBAN].via.str.size < HBP_IBAN_MIN ||
+				params[HBP_REQ_TRANSFER_IBAN].via.str.size > HBP_IBAN_MAX))
+		return false;
+	memcpy(iban, params[HBP_REQ_TRANSFER_IBAN].via.str.ptr, params[HBP_REQ_TRANSFER_IBAN].via.str.size);
+	iban[params[HBP_REQ_TRANSFER_IBAN].via.str.size] = '\0';
 
 	/* @param amount */
-	amount = array[HBP_REQ_TRANSFER_AMOUNT].via.i64;
+	amount = params[HBP_REQ_TRANSFER_AMOUNT].via.i64;
+
+	/* the amount must be a positive number, a transfer of nothing isn't a transfer (see #HBP_REQ_TRANSFER) */
+	if (amount <= 0)
+		return false;
 
 	/* @param type */
 	reply->type = HBP_REP_TRANSFER;
 
 	if (!conn->foreign)
-		res = local_transfer(conn, pack, iban, amount);
+		result = local_transfer(conn, iban, amount);
 	else
-		res = noob_transfer(conn, pack, iban, amount);
+		result = noob_transfer(conn, iban, amount);
 
-err:
-	msgpack_unpacked_destroy(&unpacked);
-	msgpack_unpacker_destroy(&unpack);
+	/* record every attempt, including the ones that failed */
+	journal_write(conn, JOURNAL_TRANSFER, HBP_REQ_TRANSFER, conn->iban, iban, amount,
+			result < 0 ? JOURNAL_RESULT_ERROR : result);
 
-	return res;
+	if (result < 0)
+		return false;
+
+	/*
+	 * local transfers are recorded in `transactions` by the transfer itself, cash paid out to cards of other banks is
+	 * recorded here, this doesn't wait for the database
+	 */
+	if (conn->foreign && result == HBP_TRANSFER_SUCCESS)
+		history_record(conn->iban, iban, amount, result);
+
+	/* @param result */
+	msgpack_pack_int(pack, result);
+
+	return true;
 }
@@ -0,0 +1,310 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <string.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+/* read a big-endian unsigned integer of n bytes */
+static uint64_t be(const unsigned char *p, unsigned int n)
+{
+	uint64_t v = 0;
+
+	while (n--)
+		v = (v << 8) | *p++;
+
+	return v;
+}
+
+/*
+ * decode the header of the next msgpack object
+ *
+ * On return kind holds the first byte (with the fixed formats folded into their generic counterparts), val the
+ * integer value, string/binary length or number of elements and len the number of payload bytes following the header.
+ */
+static bool header(struct unpacker *u, unsigned char *kind, uint64_t *val, uint64_t *len)
+{
+	const unsigned char *p = u->ptr;
+	unsigned int n;
+	unsigned char c;
+
+	if (p >= u->end)
+		return false;
+	c = *p++;
+	*len = 0;
+
+	if (c <= 0x7f) {
+		/* positive fixint */
+		*kind = 0xcf;
+		*val = c;
+	} else if (c <= 0x8f) {
+		/* fixmap */
+		*kind = 0xdf;
+		*val = c & 0x0f;
+	} else if (c <= 0x9f) {
+		/* fixarray */
+		*kind = 0xdd;
+		*val = c & 0x0f;
+	} else if (c <= 0xbf) {
+		/* fixstr */
+		*kind = 0xdb;
+		*val = *len = c & 0x1f;
+	} else if (c >= 0xe0) {
+		/* negative fixint */
+		*kind = 0xd3;
+		*val = (uint64_t) (int64_t) (int8_t) c;
+	} else {
+		switch (c) {
+		case 0xc0: /* nil */
+		case 0xc2: /* false */
+		case 0xc3: /* true */
+			*kind = c;
+			*val = 0;
+			break;
+		case 0xc4: /* bin 8/16/32 */
+		case 0xc5:
+		case 0xc6:
+			n = 1 << (c - 0xc4);
+			if (u->end - p < n)
+				return false;
+			*kind = 0xc6;
+			*val = *len = be(p, n);
+			p += n;
+			break;
+		case 0xc7: /* ext 8/16/32 */
+		case 0xc8:
+		case 0xc9:
+			n = 1 << (c - 0xc7);
+			if (u->end - p < n + 1)
+				return false;
+			*kind = 0xc9;
+			*val = be(p, n);
+			*len = *val + 1;
+			p += n;
+			break;
+		case 0xca: /* float 32/64 */
+		case 0xcb:
+			*kind = c;
+			*len = c == 0xca ? 4 : 8;
+			break;
+		case 0xcc: /* uint 8/16/32/64 */
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			n = 1 << (c - 0xcc);
+			if (u->end - p < n)
+				return false;
+			*kind = 0xcf;
+			*val = be(p, n);
+			p += n;
+			break;
+		case 0xd0: /* int 8/16/32/64 */
+		case 0xd1:
+		case 0xd2:
+		case 0xd3:
+			n = 1 << (c - 0xd0);
+			if (u->end - p < n)
+				return false;
+			*kind = 0xd3;
+			*val = be(p, n);
+			/* sign-extend */
+			if (n < 8 && (*val >> (n * 8 - 1)))
+				*val |= ~UINT64_C(0) << (n * 8);
+			p += n;
+			break;
+		case 0xd4: /* fixext 1/2/4/8/16 */
+		case 0xd5:
+		case 0xd6:
+		case 0xd7:
+		case 0xd8:
+			*kind = 0xc9;
+			*val = 1 << (c - 0xd4);
+			*len = *val + 1;
+			break;
+		case 0xd9: /* str 8/16/32 */
+		case 0xda:
+		case 0xdb:
+			n = 1 << (c - 0xd9);
+			if (u->end - p < n)
+				return false;
+			*kind = 0xdb;
+			*val = *len = be(p, n);
+			p += n;
+			break;
+		case 0xdc: /* array 16/32 */
+		case 0xdd:
+			n = c == 0xdc ? 2 : 4;
+			if (u->end - p < n)
+				return false;
+			*kind = 0xdd;
+			*val = be(p, n);
+			p += n;
+			break;
+		case 0xde: /* map 16/32 */
+		case 0xdf:
+			n = c == 0xde ? 2 : 4;
+			if (u->end - p < n)
+				return false;
+			*kind = 0xdf;
+			*val = be(p, n);
+			p += n;
+			break;
+		/* 0xc1 is never used */
+		default:
+			return false;
+		}
+	}
+
+	if ((uint64_t) (u->end - p) < *len)
+		return false;
+
+	u->ptr = p;
+
+	return true;
+}
+
+/* skip the next msgpack object, including all of its elements */
+static bool skip(struct unpacker *u)
+{
+	unsigned char kind;
+	uint64_t val, len, left = 1;
+
+	while (left--) {
+		if (!header(u, &kind, &val, &len))
+			return false;
+		u->ptr += len;
+
+		/* every element takes at least 1 byte, which bounds this by the length of the data */
+		if (kind == 0xdd)
+			left += val;
+		else if (kind == 0xdf)
+			left += val * 2;
+
+		if (left > (uint64_t) (u->end - u->ptr))
+			return false;
+	}
+
+	return true;
+}
+
+void unpack_init(struct unpacker *u, const char *data, uint16_t len)
+{
+	u->ptr = (const unsigned char *) data;
+	u->end = u->ptr + len;
+}
+
+bool unpack_array(struct unpacker *u, uint32_t *n)
+{
+	const unsigned char *start = u->ptr;
+	unsigned char kind;
+	uint64_t val, len;
+
+	if (!header(u, &kind, &val, &len) || kind != 0xdd) {
+		u->ptr = start;
+		return false;
+	}
+
+	*n = val;
+
+	return true;
+}
+
+bool unpack_param(struct unpacker *u, param_type_t type, struct param *param)
+{
+	const unsigned char *start = u->ptr;
+	unsigned char kind;
+	uint64_t val, len;
+
+	if (type == PARAM_RAW) {
+		if (!skip(u))
+			return false;
+
+		param->type = *start == 0xc0 ? PARAM_NIL : PARAM_RAW;
+		param->via.raw.ptr = (const char *) start;
+		param->via.raw.size = u->ptr - start;
+
+		return true;
+	}
+
+	if (!header(u, &kind, &val, &len))
+		goto err;
+
+	switch (type) {
+	case PARAM_NIL:
+		if (kind != 0xc0)
+			goto err;
+		break;
+	case PARAM_UINT:
+		/* non-negative values may also have been packed as a signed integer */
+		if ((kind != 0xcf && kind != 0xd3) || (kind == 0xd3 && (int64_t) val < 0))
+			goto err;
+		param->via.u64 = val;
+		break;
+	case PARAM_INT:
+		if ((kind != 0xcf && kind != 0xd3) || (kind == 0xcf && val > INT64_MAX))
+			goto err;
+		param->via.i64 = (int64_t) val;
+		break;
+	case PARAM_STR:
+		if (kind != 0xdb)
+			goto err;
+		param->via.str.ptr = (const char *) u->ptr;
+		param->via.str.size = len;
+		u->ptr += len;
+		break;
+	default:
+		goto err;
+	}
+
+	param->type = type;
+
+	return true;
+
+err:
+	u->ptr = start;
+
+	return false;
+}
+
+bool unpack_params(const char *data, uint16_t len, const param_type_t *schema, struct param *params, uint32_t count)
+{
+	struct unpacker u;
+	uint32_t i, n;
+
+	unpack_init(&u, data, len);
+
+	/* the parameters are an array with exactly the number of elements from the schema */
+	if (!unpack_array(&u, &n) || n != count)
+		return false;
+
+	for (i = 0; i < count; i++)
+		if (!unpack_param(&u, schema[i], &params[i]))
+			return false;
+
+	/* reject trailing garbage */
+	return u.ptr == u.end;
+}
@@ -0,0 +1,451 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+/* number of submission queue entries per ring */
+#define URING_ENTRIES		4096
+
+/* operations, stored in the lower bits of the user data of a submission (connections are aligned to at least 8) */
+#define OP_ACCEPT	0
+#define OP_READ		1
+#define OP_WRITE	2
+#define OP_WAKE		3
+#define OP_SIGNAL	4
+#define OP_MASK		7
+
+/* event loop driven by io_uring, the reactor must be the first member so connections can find their ring */
+struct ring {
+	struct reactor	reactor;
+	struct io_uring	ring;
+
+	/* connection structures (see connections_max), their buffers are registered for fixed reads and writes */
+	struct connection *conns;
+	bool		fixed;
+	unsigned int	*free;
+	unsigned int	nfree;
+
+	/* connections given back by the workers, the ring is woken up through an eventfd */
+	struct connection *ready;
+	pthread_mutex_t	ready_lock;
+	int		wakefd;
+	uint64_t	wakeval;
+};
+
+static struct ring *rings;
+static unsigned int nrings;
+static int sigfd = -1;
+static struct signalfd_siginfo siginfo;
+
+/* get a submission queue entry, submitting what's queued already if the submission queue is full */
+static struct io_uring_sqe *uring_sqe(struct ring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = io_uring_get_sqe(&r->ring)))
+		io_uring_submit(&r->ring);
+
+	return sqe;
+}
+
+static void uring_accept(struct ring *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	/* client sockets are left blocking, the ring waits for them to become ready by itself */
+	io_uring_prep_accept(sqe, r->reactor.sock, NULL, NULL, SOCK_CLOEXEC);
+	io_uring_sqe_set_data(sqe, (void *) (uintptr_t) OP_ACCEPT);
+}
+
+static void uring_wait(struct ring *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	io_uring_prep_read(sqe, r->wakefd, &r->wakeval, sizeof(r->wakeval), 0);
+	io_uring_sqe_set_data(sqe, (void *) (uintptr_t) OP_WAKE);
+}
+
+static void uring_signal(struct ring *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	io_uring_prep_read(sqe, sigfd, &siginfo, sizeof(siginfo), 0);
+	io_uring_sqe_set_data(sqe, (void *) (uintptr_t) OP_SIGNAL);
+}
+
+/* send pending replies or receive more data, a connection never has more than one operation in flight */
+static void uring_next(struct ring *r, struct connection *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+	size_t n;
+	char *buf;
+
+	/* every connection has 2 registered buffers, its input buffer followed by its output buffer */
+	if (conn->outlen) {
+		if (r->fixed)
+			io_uring_prep_write_fixed(sqe, conn->socket, conn->outbuf, conn->outlen, 0,
+					(conn - r->conns) * 2 + 1);
+		else
+			io_uring_prep_write(sqe, conn->socket, conn->outbuf, conn->outlen, 0);
+		io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) conn | OP_WRITE));
+	} else {
+		n = session_want(conn, &buf);
+
+		if (r->fixed)
+			io_uring_prep_read_fixed(sqe, conn->socket, buf, n, 0, (conn - r->conns) * 2);
+		else
+			io_uring_prep_read(sqe, conn->socket, buf, n, 0);
+		io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) conn | OP_READ));
+	}
+}
+
+/* give the connection structure back to the ring */
+static void uring_release(struct ring *r, struct connection *conn)
+{
+	r->free[r->nfree++] = conn - r->conns;
+}
+
+static void uring_close(struct ring *r, struct connection *conn)
+{
+	session_close(conn);
+	uring_release(r, conn);
+}
+
+/* account for n received bytes and hand off every complete request in the input buffer */
+static void uring_continue(struct ring *r, struct connection *conn, size_t n)
+{
+	for (;;) {
+		/* don't take out any new requests until there's room for the reply */
+		if (!session_writable(conn))
+			break;
+
+		switch (session_received(conn, n)) {
+		case 1:
+			/* the worker will give the connection back to us when it's done */
+			if (worker_submit(conn))
+				return;
+
+			/* all workers are busy */
+			if (!session_reject(conn)) {
+				uring_close(r, conn);
+				return;
+			}
+
+			n = 0;
+			continue;
+		case 0:
+			break;
+		default:
+			uring_close(r, conn);
+			return;
+		}
+
+		break;
+	}
+
+	uring_next(r, conn);
+}
+
+/* setup a newly accepted client connection */
+static void uring_open(struct ring *r, int csock)
+{
+	struct connection *conn;
+
+	if (!r->nfree) {
+		iprintf("too many connections, the maximum is %u per acceptor (see -m)\n", connections_max);
+		close(csock);
+		return;
+	}
+
+	conn = &r->conns[r->free[--r->nfree]];
+	memset(conn, 0, sizeof(struct connection));
+	conn->socket = csock;
+	conn->reactor = &r->reactor;
+
+	if (!session_open(conn) || session_handshake(conn) < 0) {
+		uring_close(r, conn);
+		return;
+	}
+
+	uring_next(r, conn);
+}
+
+void reactor_rearm(struct connection *conn)
+{
+	struct ring *r = (struct ring *) conn->reactor;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&r->ready_lock);
+	conn->next = r->ready;
+	r->ready = conn;
+	pthread_mutex_unlock(&r->ready_lock);
+
+	/* wake up the ring */
+	if (write(r->wakefd, &one, sizeof(one)) < 0)
+		iprintf("%s\n", strerror(errno));
+}
+
+void reactor_drop(struct connection *conn)
+{
+	/* the ring releases the connection structure once it sees the socket has been closed */
+	session_close(conn);
+	conn->socket = -1;
+
+	reactor_rearm(conn);
+}
+
+/* continue the connections given back by the workers */
+static void uring_ready(struct ring *r)
+{
+	struct connection *conn, *next;
+
+	pthread_mutex_lock(&r->ready_lock);
+	conn = r->ready;
+	r->ready = NULL;
+	pthread_mutex_unlock(&r->ready_lock);
+
+	for (; conn; conn = next) {
+		next = conn->next;
+		conn->next = NULL;
+
+		if (conn->socket < 0)
+			uring_release(r, conn);
+		else
+			uring_continue(r, conn, 0);
+	}
+}
+
+static void uring_complete(struct ring *r, struct io_uring_cqe *cqe)
+{
+	uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+	struct connection *conn = (struct connection *) (data & ~(uintptr_t) OP_MASK);
+
+	switch (data & OP_MASK) {
+	case OP_ACCEPT:
+		if (cqe->res >= 0)
+			uring_open(r, cqe->res);
+		else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN)
+			iprintf("%s\n", strerror(-cqe->res));
+
+		uring_accept(r);
+		break;
+	case OP_READ:
+		/* try again if the read was interrupted, only close the connection on real errors */
+		if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+			uring_next(r, conn);
+			break;
+		}
+		if (cqe->res <= 0)
+			goto close;
+
+		uring_continue(r, conn, cqe->res);
+		break;
+	case OP_WRITE:
+		if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+			uring_next(r, conn);
+			break;
+		}
+		if (cqe->res < 0)
+			goto close;
+
+		/* requests that arrived together with the previous one may be waiting in the input buffer */
+		session_sent(conn, cqe->res);
+		uring_continue(r, conn, 0);
+		break;
+	case OP_WAKE:
+		uring_ready(r);
+		uring_wait(r);
+		break;
+	case OP_SIGNAL:
+		if (cqe->res == sizeof(siginfo) && siginfo.ssi_signo == SIGUSR1) {
+			worker_stats();
+			db_stats();
+			commit_stats();
+			history_stats();
+			session_stats();
+		}
+
+		uring_signal(r);
+		break;
+	}
+
+	return;
+
+close:
+	uring_close(r, conn);
+}
+
+static void *reactor_thread(void *args)
+{
+	struct ring *r = args;
+	struct io_uring_cqe *cqe;
+	unsigned int head, n;
+	int res;
+
+	for (;;) {
+		/* submit everything that has been queued in one go and wait for at least one completion */
+		if ((res = io_uring_submit_and_wait(&r->ring, 1)) < 0 && res != -EINTR) {
+			iprintf("%s\n", strerror(-res));
+			return NULL;
+		}
+
+		n = 0;
+		io_uring_for_each_cqe(&r->ring, head, cqe) {
+			uring_complete(r, cqe);
+			n++;
+		}
+		io_uring_cq_advance(&r->ring, n);
+	}
+
+	return NULL;
+}
+
+/* pin a reactor thread to a CPU */
+static void reactor_pin(struct reactor *reactor, pthread_t thread)
+{
+	cpu_set_t set;
+	long ncpus;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(reactor->id % ncpus, &set);
+	if (pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set))
+		iprintf("unable to pin acceptor %u to CPU %ld\n", reactor->id, reactor->id % ncpus);
+}
+
+/* setup a ring and its connection structures */
+static bool uring_init(struct ring *r)
+{
+	struct iovec *iov;
+	unsigned int i;
+	int res;
+
+	if ((res = io_uring_queue_init(URING_ENTRIES, &r->ring, 0)) < 0) {
+		iprintf("unable to create io_uring instance: %s\n", strerror(-res));
+		return false;
+	}
+
+	if (!(r->conns = calloc(connections_max, sizeof(struct connection))) ||
+			!(r->free = calloc(connections_max, sizeof(unsigned int))) ||
+			!(iov = calloc(connections_max * 2, sizeof(struct iovec)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+	for (r->nfree = 0; r->nfree < connections_max; r->nfree++)
+		r->free[r->nfree] = connections_max - r->nfree - 1;
+
+	/* only the buffers are registered (and pinned), not the rest of the connection structures */
+	for (i = 0; i < connections_max; i++) {
+		iov[i * 2].iov_base = r->conns[i].inbuf;
+		iov[i * 2].iov_len = CONN_INBUF_SIZE;
+		iov[i * 2 + 1].iov_base = r->conns[i].outbuf;
+		iov[i * 2 + 1].iov_len = CONN_OUTBUF_SIZE;
+	}
+
+	/* fall back to regular reads and writes if that isn't possible (e.g. because of RLIMIT_MEMLOCK) */
+	if ((res = io_uring_register_buffers(&r->ring, iov, connections_max * 2)) < 0)
+		iprintf("unable to register buffers, using regular reads and writes: %s\n", strerror(-res));
+	r->fixed = res >= 0;
+	free(iov);
+
+	pthread_mutex_init(&r->ready_lock, NULL);
+	if ((r->wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		iprintf("%s\n", strerror(errno));
+		return false;
+	}
+
+	uring_accept(r);
+	uring_wait(r);
+
+	return true;
+}
+
+bool reactor_run(const int *socks, unsigned int count)
+{
+	sigset_t mask;
+
+	if (!(rings = calloc(count, sizeof(struct ring)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	for (nrings = 0; nrings < count; nrings++) {
+		rings[nrings].reactor.id = nrings;
+		rings[nrings].reactor.sock = socks[nrings];
+		rings[nrings].reactor.epfd = -1;
+
+		if (!uring_init(&rings[nrings]))
+			return false;
+	}
+
+	/* receive SIGUSR1 through the first ring */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if ((sigfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+		iprintf("%s\n", strerror(errno));
+		return false;
+	}
+	uring_signal(&rings[0]);
+
+	/* with multiple acceptors, every one of them gets its own thread pinned to its own CPU */
+	for (unsigned int i = 1; i < nrings; i++) {
+		if (pthread_create(&rings[i].reactor.thread, NULL, reactor_thread, &rings[i])) {
+			iprintf("unable to allocate thread\n");
+			return false;
+		}
+
+		reactor_pin(&rings[i].reactor, rings[i].reactor.thread);
+	}
+
+	/* the first ring runs on the calling thread */
+	rings[0].reactor.thread = pthread_self();
+	if (nrings > 1)
+		reactor_pin(&rings[0].reactor, rings[0].reactor.thread);
+
+	reactor_thread(&rings[0]);
+
+	return false;
+}
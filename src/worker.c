@@ -0,0 +1,590 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "hbp.h"
+#include "herbank.h"
+
+static struct worker *workers;
+static unsigned int nworkers;
+
+/* worker running on this thread */
+static __thread struct worker *self;
+
+/* connections waiting for a worker */
+static struct connection *queue_head, *queue_tail;
+static unsigned int queue_len, queue_size, queue_peak;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* workers with requests in flight wait in epoll_wait(2) rather than on queue_cond, this wakes them up */
+static int queue_fd = -1;
+static unsigned int queue_sleeping, queue_polling;
+
+/* threads that aren't workers wait for worker_wake() on this */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+/* blocking call made by worker_run(), on the stack of the request that's parked until it has returned */
+struct worker_call {
+	void			(*fn)(void *);
+	void			*arg;
+	struct waiter		waiter;
+	struct worker_call	*next;
+};
+
+/* blocking calls waiting for one of the blocking threads */
+static pthread_t blocking[WORKER_BLOCKING];
+static struct worker_call *calls_head, *calls_tail;
+static unsigned int calls_len, calls_peak;
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t calls_cond = PTHREAD_COND_INITIALIZER;
+
+/* statistics */
+static unsigned long stat_submitted, stat_rejected, stat_calls;
+static atomic_ulong stat_parked;
+
+/* take a connection off the queue, only wait for one if the worker has nothing in flight */
+static struct connection *worker_dequeue(struct worker *worker)
+{
+	struct connection *conn;
+	bool polling = worker->active;
+
+	pthread_mutex_lock(&queue_lock);
+
+	/* keep track of how this worker has to be woken up */
+	if (polling && !worker->polling)
+		queue_polling++;
+	else if (!polling && worker->polling)
+		queue_polling--;
+	worker->polling = polling;
+
+	if (!polling) {
+		queue_sleeping++;
+		while (!queue_head)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		queue_sleeping--;
+	}
+
+	if ((conn = queue_head)) {
+		if (!(queue_head = conn->next))
+			queue_tail = NULL;
+		queue_len--;
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	if (conn)
+		conn->next = NULL;
+
+	return conn;
+}
+
+/* switch to a fiber until it's parked or done */
+static void fiber_switch(struct worker *worker, struct fiber *fiber)
+{
+	worker->current = fiber;
+	swapcontext(&worker->ctx, &fiber->ctx);
+	worker->current = NULL;
+
+	/* done, the fiber can be reused */
+	if (!fiber->conn) {
+		fiber->next = worker->free;
+		worker->free = fiber;
+		worker->active--;
+	}
+}
+
+static void fiber_main(void)
+{
+	struct worker *worker = self;
+	struct fiber *fiber = worker->current;
+	struct connection *conn = fiber->conn;
+
+	/* handle the request(s) and give the connection back to the event loop */
+	if (session_process(conn, worker) < 0 || session_flush(conn) < 0)
+		reactor_drop(conn);
+	else
+		reactor_rearm(conn);
+
+	/* returning switches back to the scheduler through uc_link */
+	fiber->conn = NULL;
+}
+
+/* handle a connection on a free fiber */
+static void fiber_start(struct worker *worker, struct connection *conn)
+{
+	struct fiber *fiber = worker->free;
+
+	worker->free = fiber->next;
+	worker->active++;
+
+	fiber->conn = conn;
+	fiber->fd = -1;
+
+	getcontext(&fiber->ctx);
+	fiber->ctx.uc_stack.ss_sp = fiber->stack;
+	fiber->ctx.uc_stack.ss_size = WORKER_STACK_SIZE;
+	fiber->ctx.uc_link = &worker->ctx;
+	makecontext(&fiber->ctx, fiber_main, 0);
+
+	fiber_switch(worker, fiber);
+}
+
+/* translate between MYSQL_WAIT_* flags and epoll(7) events, poll(2) uses the same values */
+static int wait_events(int status)
+{
+	return (status & MYSQL_WAIT_READ ? EPOLLIN : 0) | (status & MYSQL_WAIT_WRITE ? EPOLLOUT : 0) |
+			(status & MYSQL_WAIT_EXCEPT ? EPOLLPRI : 0);
+}
+
+static int wait_status(int events)
+{
+	/* let the client library find out what went wrong */
+	if (events & (EPOLLERR | EPOLLHUP))
+		return MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+
+	return (events & EPOLLIN ? MYSQL_WAIT_READ : 0) | (events & EPOLLOUT ? MYSQL_WAIT_WRITE : 0) |
+			(events & EPOLLPRI ? MYSQL_WAIT_EXCEPT : 0);
+}
+
+/* block the calling thread until the file descriptor is ready, for callers that aren't running on a fiber */
+static int wait_blocking(int fd, int status, unsigned int timeout)
+{
+	struct pollfd pfd = {
+		.fd	= fd,
+		.events	= wait_events(status)
+	};
+	int res;
+
+	while ((res = poll(&pfd, 1, status & MYSQL_WAIT_TIMEOUT ? (int) timeout : -1)) < 0 && errno == EINTR)
+		;
+
+	if (res < 0) {
+		iprintf("unable to wait for the database: %s\n", strerror(errno));
+		return status & ~MYSQL_WAIT_TIMEOUT;
+	}
+
+	return res ? wait_status(pfd.revents) : MYSQL_WAIT_TIMEOUT;
+}
+
+/* park the current fiber until the file descriptor is ready or the timeout (in milliseconds) expires */
+static int fiber_park(struct worker *worker, int fd, int status, unsigned int timeout)
+{
+	struct fiber *fiber = worker->current;
+	struct epoll_event event = {
+		.events		= wait_events(status),
+		.data.ptr	= fiber
+	};
+
+	if (fd >= 0 && epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		iprintf("unable to watch the database: %s\n", strerror(errno));
+		return wait_blocking(fd, status, timeout);
+	}
+
+	fiber->fd = fd;
+	fiber->status = status;
+	fiber->ready = 0;
+
+	if (status & MYSQL_WAIT_TIMEOUT) {
+		clock_gettime(CLOCK_MONOTONIC, &fiber->deadline);
+		fiber->deadline.tv_sec += timeout / 1000;
+		if ((fiber->deadline.tv_nsec += (timeout % 1000) * 1000000) >= 1000000000) {
+			fiber->deadline.tv_sec++;
+			fiber->deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	fiber->next = worker->parked;
+	worker->parked = fiber;
+	stat_parked++;
+
+	/* the scheduler resumes this fiber once it's ready */
+	swapcontext(&fiber->ctx, &worker->ctx);
+
+	if (fd >= 0)
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, fd, NULL);
+	fiber->fd = -1;
+
+	return fiber->ready;
+}
+
+/* mark the fibers other threads have woken up as ready */
+static void worker_woken(struct worker *worker)
+{
+	struct fiber *woken[WORKER_FIBERS];
+	ssize_t len;
+	int i;
+
+	while ((len = read(worker->wakefd[0], woken, sizeof(woken))) > 0) {
+		/* a fiber may have noticed it has been woken up before it was parked, it could be doing anything now */
+		for (i = 0; i < len / (ssize_t) sizeof(struct fiber *); i++) {
+			if (woken[i]->conn && woken[i]->fd < 0 && !woken[i]->status)
+				woken[i]->ready = MYSQL_WAIT_READ;
+		}
+	}
+}
+
+/* milliseconds until a deadline, 0 if it has passed already */
+static int remaining(const struct timespec *deadline, const struct timespec *now)
+{
+	long long ms = (deadline->tv_sec - now->tv_sec) * 1000LL + (deadline->tv_nsec - now->tv_nsec + 999999) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/* wait for the parked fibers to become ready (or for new connections on the queue) and resume them */
+static void worker_poll(struct worker *worker)
+{
+	struct epoll_event events[WORKER_FIBERS + 1];
+	struct fiber *fiber, **prev, *ready = NULL;
+	struct timespec now;
+	int timeout = -1, ms, n, i;
+
+	/* wait no longer than until the first wait times out */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (fiber = worker->parked; fiber; fiber = fiber->next) {
+		if (!(fiber->status & MYSQL_WAIT_TIMEOUT))
+			continue;
+
+		ms = remaining(&fiber->deadline, &now);
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+
+	if ((n = epoll_wait(worker->epfd, events, WORKER_FIBERS + 1, timeout)) < 0) {
+		if (errno != EINTR)
+			iprintf("epoll_wait failed: %s\n", strerror(errno));
+		n = 0;
+	}
+
+	/* the queue has no fiber attached, it's looked at again by the caller anyway */
+	for (i = 0; i < n; i++) {
+		if (events[i].data.ptr == worker)
+			worker_woken(worker);
+		else if ((fiber = events[i].data.ptr))
+			fiber->ready = wait_status(events[i].events);
+	}
+
+	/* collect the fibers that are ready or have timed out first, resuming them might park them again */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (prev = &worker->parked; (fiber = *prev);) {
+		if (!fiber->ready && (fiber->status & MYSQL_WAIT_TIMEOUT) && !remaining(&fiber->deadline, &now))
+			fiber->ready = MYSQL_WAIT_TIMEOUT;
+
+		if (fiber->ready) {
+			*prev = fiber->next;
+			fiber->next = ready;
+			ready = fiber;
+		} else {
+			prev = &fiber->next;
+		}
+	}
+
+	while ((fiber = ready)) {
+		ready = fiber->next;
+		fiber_switch(worker, fiber);
+	}
+}
+
+static void *worker_thread(void *args)
+{
+	struct worker *worker = args;
+	struct connection *conn;
+
+	self = worker;
+
+	for (;;) {
+		/* take on new connections while there are free fibers */
+		while (worker->free && (conn = worker_dequeue(worker)))
+			fiber_start(worker, conn);
+
+		/* and resume the ones that were waiting for the database */
+		if (worker->active)
+			worker_poll(worker);
+	}
+
+	return NULL;
+}
+
+static void *blocking_thread(void *args)
+{
+	struct worker_call *call;
+	sigset_t mask;
+
+	/* signals are handled by the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	for (;;) {
+		pthread_mutex_lock(&calls_lock);
+		while (!calls_head)
+			pthread_cond_wait(&calls_cond, &calls_lock);
+
+		call = calls_head;
+		if (!(calls_head = call->next))
+			calls_tail = NULL;
+		calls_len--;
+		pthread_mutex_unlock(&calls_lock);
+
+		call->fn(call->arg);
+
+		/* the call may be gone once its request has been woken up */
+		worker_wake(&call->waiter);
+	}
+
+	return NULL;
+}
+
+/* allocate the epoll(7) instance and the fibers of a worker */
+static bool worker_init(struct worker *worker)
+{
+	struct epoll_event event = {
+		.events		= EPOLLIN | EPOLLET,
+		.data.ptr	= NULL
+	};
+	struct epoll_event wake = {
+		.events		= EPOLLIN,
+		.data.ptr	= worker
+	};
+	struct fiber *fiber;
+	unsigned int i;
+
+	/* only the reading end is non-blocking, a full pipe just slows the waking thread down */
+	if (pipe2(worker->wakefd, O_CLOEXEC) < 0 || fcntl(worker->wakefd[0], F_SETFL, O_NONBLOCK) < 0) {
+		iprintf("unable to create pipe: %s\n", strerror(errno));
+		return false;
+	}
+
+	if ((worker->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+			epoll_ctl(worker->epfd, EPOLL_CTL_ADD, queue_fd, &event) < 0 ||
+			epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wakefd[0], &wake) < 0) {
+		iprintf("unable to create epoll instance: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (!(worker->fibers = calloc(WORKER_FIBERS, sizeof(struct fiber)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+
+	for (i = 0; i < WORKER_FIBERS; i++) {
+		fiber = &worker->fibers[i];
+
+		/* the lowest page is a guard page, so an overflowing stack crashes rather than corrupts */
+		if ((fiber->stack = mmap(NULL, WORKER_STACK_SIZE, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0)) == MAP_FAILED ||
+				mprotect(fiber->stack, sysconf(_SC_PAGESIZE), PROT_NONE) < 0) {
+			iprintf("out of memory\n");
+			return false;
+		}
+
+		fiber->fd = -1;
+		fiber->next = worker->free;
+		worker->free = fiber;
+	}
+
+	return true;
+}
+
+bool worker_start(unsigned int count, unsigned int queue_max)
+{
+	struct worker *worker;
+	unsigned int i;
+
+	if (!(workers = calloc(count, sizeof(struct worker)))) {
+		iprintf("out of memory\n");
+		return false;
+	}
+	queue_size = queue_max;
+
+	if ((queue_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		iprintf("unable to create eventfd: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < WORKER_BLOCKING; i++) {
+		if (pthread_create(&blocking[i], NULL, blocking_thread, NULL)) {
+			iprintf("unable to allocate thread\n");
+			return false;
+		}
+	}
+
+	iprintf(" Starting %u workers...\n", count);
+	for (nworkers = 0; nworkers < count; nworkers++) {
+		worker = &workers[nworkers];
+		worker->id = nworkers;
+
+		if (!worker_init(worker))
+			return false;
+
+		if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+			iprintf("unable to allocate thread\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool worker_submit(struct connection *conn)
+{
+	pthread_mutex_lock(&queue_lock);
+
+	/* reject the request if too many requests are waiting already */
+	if (queue_len >= queue_size) {
+		stat_rejected++;
+		pthread_mutex_unlock(&queue_lock);
+
+		return false;
+	}
+
+	if (queue_tail)
+		queue_tail->next = conn;
+	else
+		queue_head = conn;
+	queue_tail = conn;
+
+	if (++queue_len > queue_peak)
+		queue_peak = queue_len;
+	stat_submitted++;
+
+	/* the eventfd is edge-triggered, every write wakes up the workers that are polling */
+	if (queue_sleeping)
+		pthread_cond_signal(&queue_cond);
+	else if (queue_polling)
+		eventfd_write(queue_fd, 1);
+	pthread_mutex_unlock(&queue_lock);
+
+	return true;
+}
+
+int worker_wait(int fd, int status, unsigned int timeout)
+{
+	if (!self || !self->current)
+		return wait_blocking(fd, status, timeout);
+
+	return fiber_park(self, fd, status, timeout);
+}
+
+void worker_prepare(struct waiter *waiter)
+{
+	waiter->worker = self && self->current ? self : NULL;
+	waiter->fiber = waiter->worker ? self->current : NULL;
+	atomic_init(&waiter->woken, false);
+}
+
+void worker_sleep(struct waiter *waiter)
+{
+	if (!waiter->fiber) {
+		pthread_mutex_lock(&wake_lock);
+		while (!atomic_load(&waiter->woken))
+			pthread_cond_wait(&wake_cond, &wake_lock);
+		pthread_mutex_unlock(&wake_lock);
+
+		return;
+	}
+
+	/* parked without a file descriptor or a timeout, only worker_wake() resumes it */
+	while (!atomic_load(&waiter->woken))
+		fiber_park(self, -1, 0, 0);
+}
+
+void worker_wake(struct waiter *waiter)
+{
+	struct worker *worker = waiter->worker;
+	struct fiber *fiber = waiter->fiber;
+
+	if (!fiber) {
+		pthread_mutex_lock(&wake_lock);
+		atomic_store(&waiter->woken, true);
+		pthread_cond_broadcast(&wake_cond);
+		pthread_mutex_unlock(&wake_lock);
+
+		return;
+	}
+
+	/* the waiter may be gone once it's woken up, only its fiber is left to be resumed */
+	atomic_store(&waiter->woken, true);
+	if (write(worker->wakefd[1], &fiber, sizeof(fiber)) != sizeof(fiber))
+		iprintf("unable to wake up worker %u: %s\n", worker->id, strerror(errno));
+}
+
+void worker_run(void (*fn)(void *), void *arg)
+{
+	struct worker_call call = {
+		.fn	= fn,
+		.arg	= arg,
+		.next	= NULL
+	};
+
+	/* there are no other requests to keep going */
+	if (!self || !self->current) {
+		fn(arg);
+		return;
+	}
+
+	worker_prepare(&call.waiter);
+
+	pthread_mutex_lock(&calls_lock);
+	if (calls_tail)
+		calls_tail->next = &call;
+	else
+		calls_head = &call;
+	calls_tail = &call;
+	if (++calls_len > calls_peak)
+		calls_peak = calls_len;
+	stat_calls++;
+	pthread_cond_signal(&calls_cond);
+	pthread_mutex_unlock(&calls_lock);
+
+	worker_sleep(&call.waiter);
+}
+
+void worker_stats(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	iprintf("Workers: %u, queue: %u/%u (peak %u), submitted: %lu, rejected: %lu, parked: %lu\n", nworkers,
+			queue_len, queue_size, queue_peak, stat_submitted, stat_rejected, (unsigned long) stat_parked);
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_mutex_lock(&calls_lock);
+	iprintf("Blocking calls: %u threads, waiting: %u (peak %u), calls: %lu\n", WORKER_BLOCKING, calls_len,
+			calls_peak, stat_calls);
+	pthread_mutex_unlock(&calls_lock);
+}
@@ -0,0 +1,106 @@
+/*
+ *
+ * hb-server
+ *
+ * Copyright (C) 2021 Bastiaan Teeuwen <bastiaan@mkcl.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/journal.h"
+
+static const char *events[] = {
+	[JOURNAL_LOGIN]		= "LOGIN",
+	[JOURNAL_LOGOUT]	= "LOGOUT",
+	[JOURNAL_TIMEOUT]	= "TIMEOUT",
+	[JOURNAL_TRANSFER]	= "TRANSFER"
+};
+
+static void print_record(const struct journal_record *record)
+{
+	char stamp[32], result[8];
+	time_t t = record->time;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+	if (record->result == JOURNAL_RESULT_ERROR)
+		strcpy(result, "ERROR");
+	else
+		snprintf(result, sizeof(result), "%u", record->result);
+
+	printf("%" PRIu64 "\t%s\t%.46s\t%s\t%u\t%.35s\t%u\t%u\t%s\t%.35s\t%" PRId64 "\t%s\n", record->seq, stamp,
+			record->host, record->event <= JOURNAL_TRANSFER && events[record->event] ?
+			events[record->event] : "?", record->opcode, record->iban, record->user_id, record->card_id,
+			record->foreign ? "NOOB" : "local", record->dest, record->amount, result);
+}
+
+int main(int argc, char **argv)
+{
+	struct journal_header header;
+	struct journal_record record;
+	unsigned long skipped = 0;
+	FILE *file;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s JOURNAL\n", argv[0]);
+		return 1;
+	}
+
+	if (!(file = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != JOURNAL_MAGIC ||
+			header.version != JOURNAL_VERSION || header.record_size != JOURNAL_RECORD_SIZE) {
+		fprintf(stderr, "%s: not a journal or unsupported version\n", argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	printf("seq\ttime\thost\tevent\topcode\tiban\tuser\tcard\tsession\tdest\tamount\tresult\n");
+
+	/* the file is preallocated, the empty records at the end are skipped */
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		if (!record.seq) {
+			skipped++;
+			continue;
+		}
+
+		/* empty records in between were never completed */
+		if (skipped)
+			fprintf(stderr, "%lu incomplete record(s) before %" PRIu64 "\n", skipped, record.seq);
+		skipped = 0;
+
+		print_record(&record);
+	}
+
+	fclose(file);
+
+	return 0;
+}